@@ -1,19 +1,53 @@
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <poll.h>
 #include <ncurses.h>
+#ifdef __GLIBC__
+#include <malloc.h> // malloc_trim
+#endif
 
 #define WALL 'w'
 #define POTION '#'
 #define NEEDED_POTIONS 3
-#define PLAYER '@';
+#define PLAYER '@'
+
+// walls of a cell towards its east and south neighbours, see packed_maze
+#define WALL_EAST 1
+#define WALL_SOUTH 2
+
+// movement
+enum{
+    MOVE_UP = 'w',
+    MOVE_DOWN = 's',
+    MOVE_LEFT = 'a',
+    MOVE_RIGHT = 'd'
+};
 
 struct maze{
-    char **a; // 2D array supporting maze
+    char *a; // row-major matrix supporting maze, see MAZE_AT
     unsigned int w; // width
     unsigned int h; // height
     unsigned int cell_size; // number of chars per cell; walls are 1 char
+    unsigned int stride; // number of chars in one matrix row
+    size_t capacity; // bytes owned by a, reused by regenerate_maze
 };
 
+/**
+ * Element at (row, col) of the maze matrix.
+ * All rows live in one contiguous buffer, stride chars apart.
+ */
+#define MAZE_AT(m, row, col) ((m)->a[(size_t)(row)*(m)->stride+(col)])
+
 /**
  * Represents a cell in the 2D matrix.
  */
@@ -22,6 +56,203 @@ struct cell{
     unsigned int y;
 };
 
+/**
+ * An item lying in the maze, at matrix coordinates.
+ */
+struct item{
+    unsigned int row;
+    unsigned int col;
+    char kind;
+};
+
+//-----------------------------------------------------------------------------
+
+/**
+ * Returns the time of a monotonic clock in nanoseconds.
+ */
+uint64_t now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Where the time goes. Each phase of generation, input and drawing adds
+ * its calls, time and a latency histogram to the global profile, and
+ * counters add up what the phases did. Everything is added with relaxed
+ * atomics, so phases on any thread can report, and --profile writes the
+ * profile out when the program exits.
+ * Building with -DMAZE_NO_PROFILE compiles the reporting out: the
+ * PROFILE_ macros then do nothing, and the MAZE_ allocation macros call
+ * the C library directly.
+ */
+enum profile_phase{
+    PHASE_GEN_WALLS,   // setting up the walls of a new maze
+    PHASE_GEN_CARVE,   // carving the paths
+    PHASE_GEN_POTIONS, // placing the potions
+    PHASE_CHUNK,       // generating a chunk of an endless maze
+    PHASE_MOVE,        // a move of the player
+    PHASE_FRAME,       // drawing a frame
+    PHASE_TICK,        // a tick of --simulate
+    NUM_PHASES
+};
+
+enum profile_counter{
+    COUNT_NEIGHBOUR_CHECKS, // neighbour lookups while carving
+    COUNT_PATH_PEAK,        // most cells on a carving path (the stack), over every maze
+    COUNT_BYTES_EMITTED,    // sent to the terminal by the frames
+    COUNT_ALLOCATIONS,      // calls of malloc, calloc and realloc
+    NUM_COUNTERS
+};
+
+const char *phase_names[NUM_PHASES] = {
+    "gen_walls", "gen_carve", "gen_potions", "chunk", "move", "frame", "tick"
+};
+
+const char *counter_names[NUM_COUNTERS] = {
+    "neighbour_checks", "path_peak", "bytes_emitted", "allocations"
+};
+
+#define PROFILE_BUCKETS 40 // bucket k counts latencies below 2^k ns, the last one the rest
+
+#ifndef MAZE_NO_PROFILE
+
+#define PROFILING 1
+
+struct profile{
+    atomic_ullong calls[NUM_PHASES];
+    atomic_ullong total_ns[NUM_PHASES];
+    atomic_ullong max_ns[NUM_PHASES];
+    atomic_ullong histogram[NUM_PHASES][PROFILE_BUCKETS];
+    atomic_ullong counters[NUM_COUNTERS];
+};
+
+struct profile profile;
+
+/**
+ * Raises *a to v if it is less.
+ */
+void atomic_max(atomic_ullong *a, unsigned long long v){
+    unsigned long long old = atomic_load_explicit(a, memory_order_relaxed);
+    while (old < v && !atomic_compare_exchange_weak_explicit(a, &old, v, memory_order_relaxed, memory_order_relaxed));
+}
+
+/**
+ * Records a call of phase that took ns nanoseconds.
+ */
+void profile_phase(enum profile_phase phase, uint64_t ns){
+    unsigned int k = ns ? 64 - __builtin_clzll(ns) : 0;
+    if (k >= PROFILE_BUCKETS) k = PROFILE_BUCKETS-1;
+    atomic_fetch_add_explicit(&profile.calls[phase], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&profile.total_ns[phase], ns, memory_order_relaxed);
+    atomic_fetch_add_explicit(&profile.histogram[phase][k], 1, memory_order_relaxed);
+    atomic_max(&profile.max_ns[phase], ns);
+}
+
+#define PROFILE_START(t) uint64_t t = now_ns()
+#define PROFILE_END(phase, t) profile_phase(phase, now_ns() - (t))
+#define PROFILE_COUNT(counter, n) atomic_fetch_add_explicit(&profile.counters[counter], n, memory_order_relaxed)
+#define PROFILE_MAX(counter, v) atomic_max(&profile.counters[counter], v)
+
+/**
+ * The allocation functions, counted. The rest of the file allocates
+ * through the MAZE_ macros, which call them.
+ */
+void *counted_malloc(size_t size){
+    PROFILE_COUNT(COUNT_ALLOCATIONS, 1);
+    return malloc(size);
+}
+
+void *counted_calloc(size_t n, size_t size){
+    PROFILE_COUNT(COUNT_ALLOCATIONS, 1);
+    return calloc(n, size);
+}
+
+void *counted_realloc(void *p, size_t size){
+    PROFILE_COUNT(COUNT_ALLOCATIONS, 1);
+    return realloc(p, size);
+}
+
+#define MAZE_MALLOC(size) counted_malloc(size)
+#define MAZE_CALLOC(n, size) counted_calloc(n, size)
+#define MAZE_REALLOC(p, size) counted_realloc(p, size)
+
+/**
+ * Returns the value of counter so far.
+ */
+unsigned long long profile_counter(enum profile_counter counter){
+    return atomic_load_explicit(&profile.counters[counter], memory_order_relaxed);
+}
+
+/**
+ * Writes the profile to path: CSV if the name ends in ".csv", with a
+ * kind,name,field,value line per number, JSON otherwise. Histograms list
+ * the buckets that are not empty by their upper bound.
+ * Returns 0 on success, -1 if the file can't be written.
+ */
+int write_profile(const char *path){
+    size_t len = strlen(path);
+    int csv = len >= 4 && strcmp(path+len-4, ".csv") == 0;
+    FILE *f = fopen(path, "w");
+    unsigned int p, k, c;
+    int first;
+
+    if (f == NULL) return -1;
+    if (csv) fprintf(f, "kind,name,field,value\n");
+    else fprintf(f, "{\n  \"phases\": [\n");
+    for (p = 0; p < NUM_PHASES; p++){
+        unsigned long long calls = profile.calls[p], total = profile.total_ns[p], max = profile.max_ns[p];
+        if (csv){
+            fprintf(f, "phase,%s,calls,%llu\nphase,%s,total_ns,%llu\nphase,%s,max_ns,%llu\n",
+                    phase_names[p], calls, phase_names[p], total, phase_names[p], max);
+        }else{
+            fprintf(f, "    {\"name\": \"%s\", \"calls\": %llu, \"total_ns\": %llu, \"max_ns\": %llu, \"histogram\": [",
+                    phase_names[p], calls, total, max);
+        }
+        for (k = 0, first = 1; k < PROFILE_BUCKETS; k++){
+            unsigned long long n = profile.histogram[p][k];
+            if (n == 0) continue;
+            if (csv) fprintf(f, "histogram,%s,below_ns_%llu,%llu\n", phase_names[p], 1ULL << k, n);
+            else fprintf(f, "%s{\"below_ns\": %llu, \"count\": %llu}", first ? "" : ", ", 1ULL << k, n);
+            first = 0;
+        }
+        if (!csv) fprintf(f, "]}%s\n", p+1 < NUM_PHASES ? "," : "");
+    }
+    if (!csv) fprintf(f, "  ],\n  \"counters\": {");
+    for (c = 0; c < NUM_COUNTERS; c++){
+        unsigned long long n = profile.counters[c];
+        if (csv) fprintf(f, "counter,%s,value,%llu\n", counter_names[c], n);
+        else fprintf(f, "%s\"%s\": %llu", c ? ", " : "", counter_names[c], n);
+    }
+    if (!csv) fprintf(f, "}\n}\n");
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+#else
+
+#define PROFILING 0
+#define PROFILE_START(t)
+#define PROFILE_END(phase, t)
+#define PROFILE_COUNT(counter, n) ((void)(n))
+#define PROFILE_MAX(counter, v) ((void)(v))
+#define MAZE_MALLOC(size) malloc(size)
+#define MAZE_CALLOC(n, size) calloc(n, size)
+#define MAZE_REALLOC(p, size) realloc(p, size)
+
+unsigned long long profile_counter(enum profile_counter counter){
+    (void)counter;
+    return 0;
+}
+
+int write_profile(const char *path){
+    (void)path;
+    return -1;
+}
+
+#endif
+
+//-----------------------------------------------------------------------------
+
 /**
  * Stack structure using a list of cells.
  * At element 0 in the list we have NULL.
@@ -39,7 +270,17 @@ struct stack{
  * Initialises the stack by allocating memory for the internal list
  */
 void init_stack(struct stack *stack, unsigned int capacity){
-    stack->cell_list = (struct cell*)malloc(sizeof(struct cell)*(capacity+1));
+    stack->cell_list = (struct cell*)MAZE_MALLOC(sizeof(struct cell)*(capacity+1));
+    stack->top_of_stack = 0;
+    stack->capacity = capacity;
+}
+
+/**
+ * Initialises the stack on top of an existing buffer which must be able
+ * to hold capacity+1 cells. Such a stack must not be passed to free_stack.
+ */
+void init_stack_buffer(struct stack *stack, struct cell *buffer, unsigned int capacity){
+    stack->cell_list = buffer;
     stack->top_of_stack = 0;
     stack->capacity = capacity;
 }
@@ -77,8 +318,444 @@ int stack_isempty(struct stack *stack){
 
 //-----------------------------------------------------------------------------
 
+/**
+ * Random number generator owned by its user.
+ * It is the additive feedback generator behind glibc's srandom/random
+ * (the default TYPE_3 variant), so a seed gives the same numbers, and
+ * therefore the same mazes, as the libc functions did. Unlike them it
+ * shares no state and takes no lock.
+ */
+struct maze_rng{
+    int32_t state[31];
+    unsigned int front; // index of the element being updated
+    unsigned int rear; // index of the element added to it
+};
+
+/**
+ * Returns the next number in [0, 2^31), like random().
+ */
+long rng_next(struct maze_rng *rng){
+    uint32_t val = (uint32_t)rng->state[rng->front] + (uint32_t)rng->state[rng->rear];
+    rng->state[rng->front] = val;
+    if (++rng->front == 31) rng->front = 0;
+    if (++rng->rear == 31) rng->rear = 0;
+    return val >> 1;
+}
+
+/**
+ * Seeds the generator, like srandom(seed).
+ */
+void seed_rng(struct maze_rng *rng, unsigned int seed){
+    int32_t word;
+    int i;
+    if (seed == 0) seed = 1;
+    word = rng->state[0] = seed;
+    for (i=1;i<31;i++){
+        long hi = word / 127773;
+        long lo = word % 127773;
+        word = 16807 * lo - 2836 * hi;
+        if (word < 0) word += 2147483647;
+        rng->state[i] = word;
+    }
+    rng->front = 3;
+    rng->rear = 0;
+    for (i=0;i<310;i++) rng_next(rng);
+}
+
+/**
+ * Returns a random number in [0, n), for n that may not fit in 31 bits.
+ */
+uint64_t rng_below(struct maze_rng *rng, uint64_t n){
+    uint64_t r = ((uint64_t)rng_next(rng) << 31) | rng_next(rng);
+    return r % n;
+}
+
+/**
+ * Scrambles x into a well spread 64-bit value (splitmix64 finaliser).
+ */
+uint64_t mix64(uint64_t x){
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+/**
+ * Derives a seed from seed and two numbers, e.g. the position of a part
+ * of a maze, so that each part gets its own stream of random numbers.
+ */
+unsigned int derive_seed(int seed, uint64_t a, uint64_t b){
+    return mix64((uint32_t)seed ^ mix64(a ^ mix64(b))) >> 32;
+}
+
+/**
+ * Union-find over indices: returns the representative of i's set,
+ * halving the path on the way.
+ */
+unsigned int uf_find(unsigned int *parent, unsigned int i){
+    while (parent[i] != i){
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+    return i;
+}
+
+//-----------------------------------------------------------------------------
+
+#define MAX_THREADS 1024
+
+/**
+ * Returns the number of threads to use when the caller asks for 0.
+ */
+unsigned int default_threads(void){
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+}
+
+struct parallel_for_args{
+    size_t n;
+    atomic_size_t next;
+    void (*fn)(void *arg, size_t i);
+    void *arg;
+};
+
+void *parallel_for_worker(void *p){
+    struct parallel_for_args *args = (struct parallel_for_args*)p;
+    size_t i;
+    while ((i = atomic_fetch_add(&args->next, 1)) < args->n)
+        args->fn(args->arg, i);
+    return NULL;
+}
+
+/**
+ * Calls fn(arg, i) for every i in [0, n) on up to threads threads
+ * (0 means one per processor), the calling thread being one of them.
+ * Indices are handed out one at a time as threads become free, so each
+ * runs exactly once but in no fixed order. fn must only touch data that
+ * belongs to index i.
+ */
+void parallel_for(size_t n, unsigned int threads, void (*fn)(void *arg, size_t i), void *arg){
+    struct parallel_for_args args;
+    pthread_t *workers;
+    unsigned int t, started = 0;
+
+    if (threads == 0) threads = default_threads();
+    if (threads > n) threads = n;
+    args.n = n;
+    atomic_init(&args.next, 0);
+    args.fn = fn;
+    args.arg = arg;
+
+    workers = threads > 1 ? (pthread_t*)MAZE_MALLOC(sizeof(pthread_t)*(threads-1)) : NULL;
+    if (workers != NULL)
+        for (t=0;t<threads-1;t++){
+            if (pthread_create(&workers[started], NULL, parallel_for_worker, &args) != 0) break;
+            started ++;
+        }
+    parallel_for_worker(&args);
+    for (t=0;t<started;t++) pthread_join(workers[t], NULL);
+    free(workers);
+}
+
+//-----------------------------------------------------------------------------
+
+/**
+ * Rank/select index over the free chars of a perfect maze of w x h cells,
+ * to place items at random without retrying on walls. Free chars are
+ * ranked squares first, cell_size^2 chars for each cell in order, then
+ * openings between cells, cell_size chars each; the east and south
+ * openings of a cell are its own. Squares are found by arithmetic. For
+ * openings, openings has the running count before every block of
+ * OPEN_BLOCK cells of a row, so the k-th opening is a binary search and
+ * a scan of at most OPEN_BLOCK cells away.
+ * The walls of cells are read through a function, walls(maze, x, y)
+ * returning the WALL_EAST / WALL_SOUTH bits of cell (x, y), so that the
+ * index serves the char matrix and the packed maze alike.
+ */
+struct open_index{
+    unsigned int w;
+    unsigned int h;
+    unsigned int cell_size;
+    unsigned int blocks_x; // blocks in a row of cells
+    uint64_t *openings;    // blocks_x*h+1 counts, the last one the total
+};
+
+#define OPEN_BLOCK 64
+
+/**
+ * Sets up index for a maze of w x h cells; the counts are filled in by
+ * count_openings or count_packed_openings.
+ * Returns 0 on success, -1 if out of memory.
+ */
+int init_open_index(struct open_index *index, unsigned int w, unsigned int h, unsigned int cell_size){
+    index->w = w;
+    index->h = h;
+    index->cell_size = cell_size;
+    index->blocks_x = (w+OPEN_BLOCK-1)/OPEN_BLOCK;
+    index->openings = (uint64_t*)MAZE_MALLOC(((size_t)index->blocks_x*h+1)*sizeof(uint64_t));
+    return index->openings != NULL ? 0 : -1;
+}
+
+void free_open_index(struct open_index *index){
+    free(index->openings);
+    index->openings = NULL;
+}
+
+/**
+ * Fills in the counts of index from the walls of maze.
+ */
+void count_openings(struct open_index *index, unsigned int (*walls)(const void *maze, unsigned int x, unsigned int y), const void *maze){
+    uint64_t n = 0;
+    size_t b = 0;
+    unsigned int x, y, bits;
+    for (y=0;y<index->h;y++)
+        for (x=0;x<index->w;x++){
+            if (x%OPEN_BLOCK == 0) index->openings[b++] = n;
+            bits = walls(maze, x, y);
+            n += !(bits & WALL_EAST) + !(bits & WALL_SOUTH);
+        }
+    index->openings[b] = n;
+}
+
+/**
+ * Number of free chars of the maze of index, entry and exit excluded.
+ */
+uint64_t open_chars(const struct open_index *index){
+    uint64_t squares = (uint64_t)index->w*index->h*index->cell_size*index->cell_size;
+    return squares + index->openings[(size_t)index->blocks_x*index->h]*index->cell_size;
+}
+
+/**
+ * Stores in (*row, *col) the matrix position of the free char of the
+ * given rank, below open_chars(index).
+ */
+void open_char_at(const struct open_index *index, unsigned int (*walls)(const void *maze, unsigned int x, unsigned int y), const void *maze, uint64_t rank, long *row, long *col){
+    unsigned int cs = index->cell_size, p = cs+1, x, y, bits;
+    uint64_t squares = (uint64_t)index->w*index->h*cs*cs, cell, j;
+    size_t lo = 0, hi = (size_t)index->blocks_x*index->h;
+
+    if (rank < squares){
+        cell = rank/(cs*cs);
+        *row = 1 + (long)(cell/index->w)*p + rank%(cs*cs)/cs;
+        *col = 1 + (long)(cell%index->w)*p + rank%cs;
+        return;
+    }
+    j = (rank-squares)/cs;
+    while (hi-lo > 1){ // the last block starting at or before opening j
+        size_t mid = (lo+hi)/2;
+        if (index->openings[mid] <= j) lo = mid;
+        else hi = mid;
+    }
+    y = lo/index->blocks_x;
+    x = lo%index->blocks_x*OPEN_BLOCK;
+    j -= index->openings[lo];
+    for (;;x++){
+        bits = walls(maze, x, y);
+        if (!(bits & WALL_EAST) && j-- == 0){
+            *row = 1 + (long)y*p + (rank-squares)%cs;
+            *col = (long)(x+1)*p;
+            return;
+        }
+        if (!(bits & WALL_SOUTH) && j-- == 0){
+            *row = (long)(y+1)*p;
+            *col = 1 + (long)x*p + (rank-squares)%cs;
+            return;
+        }
+    }
+}
+
+/**
+ * Draws n distinct numbers below total, n at most total, into ranks with
+ * Floyd's sampling: n draws, each checked against those before it in a
+ * hash set.
+ * Returns 0 on success, -1 if out of memory.
+ */
+int sample_ranks(struct maze_rng *rng, uint64_t total, uint64_t *ranks, unsigned int n){
+    size_t size = 16, slot;
+    uint64_t *set; // rank+1 of each draw so far, 0 for an empty slot
+    unsigned int i;
+
+    while (size < 2*(size_t)n) size *= 2;
+    if ((set = (uint64_t*)MAZE_CALLOC(size, sizeof(uint64_t))) == NULL) return -1;
+    for (i=0;i<n;i++){
+        uint64_t top = total-n+i;
+        uint64_t r = rng_below(rng, top+1);
+        for (slot=mix64(r)&(size-1);set[slot] != 0 && set[slot] != r+1;slot=(slot+1)&(size-1));
+        if (set[slot] != 0){ // drawn before, top never was
+            r = top;
+            for (slot=mix64(r)&(size-1);set[slot] != 0;slot=(slot+1)&(size-1));
+        }
+        set[slot] = r+1;
+        ranks[i] = r;
+    }
+    free(set);
+    return 0;
+}
+
+/**
+ * Returns whether matrix position (row, col) of the maze of index is a
+ * free char: inside a cell, in an opening between two cells, or the
+ * entry at (1, 0).
+ */
+int is_open_char(const struct open_index *index, unsigned int (*walls)(const void *maze, unsigned int x, unsigned int y), const void *maze, long row, long col){
+    long p = index->cell_size+1;
+    long x = col/p, y = row/p;
+
+    if (row%p != 0 && col%p != 0) return 1;
+    if (row%p == 0 && col%p == 0) return 0;
+    if (row%p == 0) return y > 0 && y < (long)index->h && !(walls(maze, x, y-1) & WALL_SOUTH);
+    if (x == 0) return row == 1;
+    return x < (long)index->w && !(walls(maze, x-1, y) & WALL_EAST);
+}
+
+/**
+ * Places potions on n distinct free chars of maze drawn at random, or on
+ * every free char if there are fewer, storing them in items.
+ * The default NEEDED_POTIONS are drawn as the first generator drew them,
+ * matrix positions tried until one is free, so that every seed keeps
+ * its potions. More are drawn as distinct ranks of index, which costs
+ * the same however full the maze gets.
+ * Returns the number of potions placed, or -1 if out of memory.
+ */
+long place_potions(const struct open_index *index, unsigned int (*walls)(const void *maze, unsigned int x, unsigned int y), const void *maze, struct maze_rng *rng, unsigned int n, struct item *items){
+    uint64_t total = open_chars(index);
+    uint64_t *ranks;
+    long row, col, mw = (long)(index->cell_size+1)*index->w+1, mh = (long)(index->cell_size+1)*index->h+1;
+    unsigned int i, j;
+
+    if (n == NEEDED_POTIONS && n <= total){
+        // Rejection sampling kept on purpose, so that every seed keeps the
+        // potions it always had. It is bounded by the density of free chars:
+        // a cell of cell_size^2 chars and its openings take (cell_size+1)^2
+        // matrix chars, so about a quarter or more are free, less the
+        // border, and a potion takes a few draws on average whatever the
+        // size of the maze.
+        for (i=0;i<n;i++){
+            do{
+                row = rng_next(rng)%(mh-1);
+                col = rng_next(rng)%(mw-1);
+                for (j=0;j<i && (items[j].row != row || items[j].col != col);j++);
+            }while (!is_open_char(index, walls, maze, row, col) || j < i);
+            items[i].row = row;
+            items[i].col = col;
+            items[i].kind = POTION;
+        }
+        return n;
+    }
+    if (n > total) n = total;
+    if ((ranks = (uint64_t*)MAZE_MALLOC(sizeof(uint64_t)*((size_t)n+1))) == NULL) return -1;
+    if (sample_ranks(rng, total, ranks, n) != 0){
+        free(ranks);
+        return -1;
+    }
+    for (i=0;i<n;i++){
+        open_char_at(index, walls, maze, ranks[i], &row, &col);
+        items[i].row = row;
+        items[i].col = col;
+        items[i].kind = POTION;
+    }
+    free(ranks);
+    return n;
+}
+
+//-----------------------------------------------------------------------------
+
+/**
+ * How generate_maze walks back when a cell has no unvisited neighbours.
+ * CARVE_STACK keeps the path on a struct stack, 8 bytes per cell.
+ * CARVE_BACKTRACK keeps it in the maze itself: each cell on the current
+ * path remembers in 2 bits the direction it was entered from, so no
+ * memory beyond the maze is needed. Both give the same maze for a seed.
+ */
+enum carve_mode{
+    CARVE_BACKTRACK,
+    CARVE_STACK
+};
+
+/**
+ * Everything one maze generation needs. Each generator has its own
+ * random number generator, so any number of mazes can be generated at
+ * the same time from different threads.
+ */
+struct maze_gen{
+    unsigned int width; // in cells
+    unsigned int height; // in cells
+    unsigned int cell_size;
+    int seed;
+    enum carve_mode mode;
+    unsigned int tile_size; // packed mazes only: carve in tiles of this many cells a side, 0 for one piece
+    unsigned int threads; // threads carving tiles, 0 for one per processor
+    unsigned int num_potions; // potions placed, NEEDED_POTIONS by default
+    struct maze_rng rng;
+};
+
+/**
+ * Sets up a generator for a maze of width x height cells with the
+ * default carve mode. The random number generator is seeded when a
+ * maze is generated, so the same generator can be used again.
+ */
+void init_maze_gen(struct maze_gen *gen, unsigned int width, unsigned int height, unsigned int cell_size, int seed){
+    gen->width = width;
+    gen->height = height;
+    gen->cell_size = cell_size;
+    gen->seed = seed;
+    gen->mode = CARVE_BACKTRACK;
+    gen->tile_size = 0;
+    gen->threads = 0;
+    gen->num_potions = NEEDED_POTIONS;
+}
+
+/**
+ * Checks that a maze of width x height cells of cell_size chars can be
+ * made: at least a cell a side, an odd cell size, matrix sides that fit
+ * an unsigned int and cells that fit a uint32_t index (see num_cells).
+ * Returns 0 if so, -1 if not.
+ */
+int check_maze_size(uint64_t width, uint64_t height, uint64_t cell_size){
+    if (width == 0 || height == 0 || cell_size % 2 == 0) return -1;
+    if (width > UINT_MAX || height > UINT_MAX || cell_size > UINT_MAX) return -1;
+    if ((cell_size+1)*width+1 > UINT_MAX || (cell_size+1)*height+1 > UINT_MAX) return -1;
+    return width*height < UINT32_MAX ? 0 : -1;
+}
+
+/**
+ * Directions, in the order get_available_neighbours lists neighbours.
+ */
+enum direction{
+    DIR_UP,
+    DIR_LEFT,
+    DIR_RIGHT,
+    DIR_DOWN
+};
+
+/**
+ * Returns the direction leading from cell a to the adjacent cell b.
+ */
+enum direction direction_between(struct cell a, struct cell b){
+    if (b.y < a.y) return DIR_UP;
+    if (b.x < a.x) return DIR_LEFT;
+    if (b.x > a.x) return DIR_RIGHT;
+    return DIR_DOWN;
+}
+
+/**
+ * Returns the direction opposite to d.
+ */
+enum direction opposite_direction(enum direction d){
+    return DIR_DOWN - d;
+}
+
+/**
+ * A cell is unvisited while its middle char is a wall (see init_matrix);
+ * the rest of its square is open from the start. With CARVE_BACKTRACK,
+ * the middle char of a cell on the current path is BACK_MARK+d, d being
+ * the direction to step back to. Cells that are done get their final ' '
+ * like with CARVE_STACK, so the matrix needs no pass after carving.
+ */
+#define BACK_MARK '0'
+
 void mark_visited(struct maze *maze, struct cell cell){
-    maze->a[cell.y][cell.x] = 'v';
+    MAZE_AT(maze, cell.y, cell.x) = ' ';
 }
 
 /**
@@ -97,53 +774,64 @@ int maze_dimension_to_matrix(struct maze *m, int dimension){
     return (m->cell_size+1)*dimension+1;
 }
 
+/**
+ * The carving code below takes the cell size as cs instead of reading
+ * it from the maze, and is always inlined, down to the wrappers of
+ * CARVE_KERNELS. A wrapper passing a constant cs gets its own copy of
+ * the carving loop in which the multiplies and divides by the cell size
+ * fold into shifts and adds and the loops over an opening unroll.
+ */
+#define KERNEL static inline __attribute__((always_inline))
+
 /**
  * Returns the index of the previous cell (cell - 1)
  */
-int matrix_idx_prev_cell(struct maze *m, int cell_num){
-    return cell_num - (m->cell_size+1);
+KERNEL int matrix_idx_prev_cell(unsigned int cs, int cell_num){
+    return cell_num - (cs+1);
 }
 
 /**
  * Returns the index of the next cell (cell + 1)
  */
-int matrix_idx_next_cell(struct maze *m, int cell_num){
-    return cell_num + (m->cell_size+1);
+KERNEL int matrix_idx_next_cell(unsigned int cs, int cell_num){
+    return cell_num + (cs+1);
 }
 
 /**
  * Returns into neighbours the unvisited neighbour cells of the given cell.
+ * A cell is unvisited as long as its middle char is still a wall.
  * Returns the number of neighbours.
  * neighbours must be able to hold 4 cells.
  */
-int get_available_neighbours(struct maze *maze, struct cell cell, struct cell *neighbours){
+KERNEL int get_available_neighbours(struct maze *maze, unsigned int cs, struct cell cell, struct cell *neighbours){
+    unsigned int first = cs/2+1; // matrix index of the first cell
     int num_neighbrs = 0;
 
     // Check above
-    if ((cell.y > cell_to_matrix_idx(maze,0)) && (maze->a[matrix_idx_prev_cell(maze, cell.y)][cell.x] != 'v')){
+    if ((cell.y > first) && (MAZE_AT(maze, matrix_idx_prev_cell(cs, cell.y), cell.x) == WALL)){
         neighbours[num_neighbrs].x = cell.x;
-        neighbours[num_neighbrs].y = matrix_idx_prev_cell(maze, cell.y);
+        neighbours[num_neighbrs].y = matrix_idx_prev_cell(cs, cell.y);
         num_neighbrs ++;
     }
 
     // Check left
-    if ((cell.x > cell_to_matrix_idx(maze,0)) && (maze->a[cell.y][matrix_idx_prev_cell(maze, cell.x)] != 'v')){
-        neighbours[num_neighbrs].x = matrix_idx_prev_cell(maze, cell.x);
+    if ((cell.x > first) && (MAZE_AT(maze, cell.y, matrix_idx_prev_cell(cs, cell.x)) == WALL)){
+        neighbours[num_neighbrs].x = matrix_idx_prev_cell(cs, cell.x);
         neighbours[num_neighbrs].y = cell.y;
         num_neighbrs ++;
     }
 
     // Check right
-    if ((cell.x < cell_to_matrix_idx(maze,maze->w-1)) && (maze->a[cell.y][matrix_idx_next_cell(maze, cell.x)] != 'v')){
-        neighbours[num_neighbrs].x = matrix_idx_next_cell(maze, cell.x);
+    if ((cell.x < first+(cs+1)*(maze->w-1)) && (MAZE_AT(maze, cell.y, matrix_idx_next_cell(cs, cell.x)) == WALL)){
+        neighbours[num_neighbrs].x = matrix_idx_next_cell(cs, cell.x);
         neighbours[num_neighbrs].y = cell.y;
         num_neighbrs ++;
     }
 
     // Check below
-    if ((cell.y < cell_to_matrix_idx(maze,maze->h-1)) && (maze->a[matrix_idx_next_cell(maze, cell.y)][cell.x] != 'v')){
+    if ((cell.y < first+(cs+1)*(maze->h-1)) && (MAZE_AT(maze, matrix_idx_next_cell(cs, cell.y), cell.x) == WALL)){
         neighbours[num_neighbrs].x = cell.x;
-        neighbours[num_neighbrs].y = matrix_idx_next_cell(maze, cell.y);
+        neighbours[num_neighbrs].y = matrix_idx_next_cell(cs, cell.y);
         num_neighbrs ++;
     }
 
@@ -154,420 +842,5409 @@ int get_available_neighbours(struct maze *maze, struct cell cell, struct cell *n
 /**
  * Removes a wall between two cells.
  */
-void remove_wall(struct maze *maze, struct cell a, struct cell b){
-    int i;
+KERNEL void remove_wall(struct maze *maze, unsigned int cs, struct cell a, struct cell b){
+    unsigned int i;
     if (a.y == b.y){
-        for (i=0;i<maze->cell_size;i++)
-            maze->a[a.y-maze->cell_size/2+i][a.x-(((int)a.x-(int)b.x))/2] = ' ';
+        for (i=0;i<cs;i++)
+            MAZE_AT(maze, a.y-cs/2+i, a.x-(((int)a.x-(int)b.x))/2) = ' ';
     }else{
-        for (i=0;i<maze->cell_size;i++)
-            maze->a[a.y-(((int)a.y-(int)b.y))/2][a.x-maze->cell_size/2+i] = ' ';
+        for (i=0;i<cs;i++)
+            MAZE_AT(maze, a.y-(((int)a.y-(int)b.y))/2, a.x-cs/2+i) = ' ';
     }
 }
 
 /**
- * Fill all matrix elements corresponding to the cell
+ * Sets up an empty maze that owns no memory yet.
  */
-void fill_cell(struct maze *maze, struct cell c, char value){
-    int i,j;
-    for (i=0;i<maze->cell_size;i++)
-        for (j=0;j<maze->cell_size;j++)
-            maze->a[c.y-maze->cell_size/2+i][c.x-maze->cell_size/2+j] = value;
+void init_maze(struct maze *maze){
+    maze->a = NULL;
+    maze->w = 0;
+    maze->h = 0;
+    maze->cell_size = 0;
+    maze->stride = 0;
+    maze->capacity = 0;
 }
 
 /**
- * This function generates a maze of width x height cells.
- * Each cell is a square of cell_size x cell_size characters.
- * The maze is randomly generated based on the supplied rand_seed.
- * Use the same rand_seed value to obtain the same maze.
- *
- * The function returns a struct maze variable containing:
- * - the maze represented as a 2D array (field a)
- * - the width (number of columns) of the array (field w)
- * - the height (number of rows) of the array (field h).
- * In the array, walls are represented with a 'w' character, while
- * pathways are represented with spaces (' ').
- * The edges of the array consist of walls, with the exception
- * of two openings, one on the left side (column 0) and one on
- * the right (column w-1) of the array. These should be used
- * as entry and exit.
+ * Releases the memory held by the maze and leaves it empty, ready to
+ * be used again with regenerate_maze.
  */
-struct maze generate_maze(unsigned int width, unsigned int height, unsigned int cell_size, int rand_seed){
-    int row, col, i;
-    struct stack stack;
+void free_maze(struct maze *maze){
+    free(maze->a);
+    init_maze(maze);
+}
+
+/**
+ * Makes sure the maze owns at least size bytes.
+ * The buffer only ever grows, so generating many mazes of similar size
+ * with the same struct maze does a single allocation.
+ * Returns 0 on success, -1 if the memory could not be allocated.
+ */
+int reserve_maze(struct maze *maze, size_t size){
+    char *a;
+    if (size <= maze->capacity) return 0;
+    a = (char*)MAZE_MALLOC(size);
+    if (a == NULL) return -1;
+    free(maze->a);
+    maze->a = a;
+    maze->capacity = size;
+    return 0;
+}
+
+/**
+ * Returns the matrix position of the cell next to c in direction d.
+ */
+KERNEL struct cell matrix_step(unsigned int cs, struct cell c, enum direction d){
+    switch (d){
+        case DIR_UP: c.y = matrix_idx_prev_cell(cs, c.y); break;
+        case DIR_LEFT: c.x = matrix_idx_prev_cell(cs, c.x); break;
+        case DIR_RIGHT: c.x = matrix_idx_next_cell(cs, c.x); break;
+        case DIR_DOWN: c.y = matrix_idx_next_cell(cs, c.y); break;
+    }
+    return c;
+}
+
+/**
+ * Depth-first carving from start, keeping the path on the given stack.
+ */
+KERNEL void carve_with_stack(struct maze *maze, unsigned int cs, struct cell start, struct stack *stack, struct maze_rng *rng){
     struct cell cell;
     struct cell neighbours[4];  // to hold neighbours of a cell
     int num_neighbs;
-    struct maze maze;
-    maze.w = width;
-    maze.h = height;
-    maze.cell_size = cell_size;
-    maze.a = (char**)malloc(sizeof(char*)*maze_dimension_to_matrix(&maze, height));
-
-    // Initialise RNG
-    srandom(rand_seed);
+    unsigned long checks = 0, peak = 1;
 
-    // Initialise stack
-    init_stack(&stack, width*height);
+    mark_visited(maze, start);
+    stack_push(stack, start);
 
-    // Initialise the matrix with walls
-    for (row=0;row<maze_dimension_to_matrix(&maze, height);row++){
-        maze.a[row] = (char*)malloc(maze_dimension_to_matrix(&maze, width));
-        memset(maze.a[row], WALL, maze_dimension_to_matrix(&maze, width));
-    }
-
-    // Select a random position on a border.
-    // Border means x=0 or y=0 or x=2*width+1 or y=2*height+1
-    cell.x = cell_to_matrix_idx(&maze,0);
-    cell.y = cell_to_matrix_idx(&maze,random()%height);
-    mark_visited(&maze, cell);
-    stack_push(&stack, cell);
-
-    while (! stack_isempty(&stack)){
+    while (! stack_isempty(stack)){
         // Take the top of stack
-        cell = stack_pop(&stack);
+        cell = stack_pop(stack);
         // Get the list of non-visited neighbours
-        num_neighbs = get_available_neighbours(&maze, cell, neighbours);
+        num_neighbs = get_available_neighbours(maze, cs, cell, neighbours);
+        checks++;
         if (num_neighbs > 0){
             struct cell next;
             // Push current cell on the stack
-            stack_push(&stack, cell);
+            stack_push(stack, cell);
             // Select one random neighbour
-            next = neighbours[random()%num_neighbs];
+            next = neighbours[rng_next(rng)%num_neighbs];
             // Mark it visited
-            mark_visited(&maze, next);
+            mark_visited(maze, next);
             // Break down the wall between the cells
-            remove_wall(&maze, cell, next);
+            remove_wall(maze, cs, cell, next);
             // Push new cell on the stack
-            stack_push(&stack, next);
+            stack_push(stack, next);
+            if (stack->top_of_stack > peak) peak = stack->top_of_stack;
         }
     }
+    PROFILE_COUNT(COUNT_NEIGHBOUR_CHECKS, checks);
+    PROFILE_MAX(COUNT_PATH_PEAK, peak);
+}
 
-    // Finally, replace 'v' with spaces
-    for (row=0;row<maze_dimension_to_matrix(&maze, height);row++)
-        for (col=0;col<maze_dimension_to_matrix(&maze, width);col++)
-            if (maze.a[row][col] == 'v'){
-                cell.y = row;
-                cell.x = col;
-                fill_cell(&maze, cell, ' ');
-            }
+/**
+ * Depth-first carving from start, keeping the path inside the maze.
+ * Makes the same random draws in the same order as carve_with_stack:
+ * where the stack version pops a dead end and then the cell below it,
+ * this one follows the back direction stored in the dead end.
+ */
+KERNEL void carve_in_place(struct maze *maze, unsigned int cs, struct cell start, struct maze_rng *rng){
+    struct cell cell = start;
+    struct cell neighbours[4];  // to hold neighbours of a cell
+    int num_neighbs;
+    unsigned long checks = 0, depth = 1, peak = 1;
 
-    // Select an entry point in the top right corner.
-    // The first border cell that is available.
-    for (row=0;row<maze_dimension_to_matrix(&maze, height);row++)
-        if (maze.a[row][1] == ' ') { maze.a[row][0] = ' '; break; }
+    mark_visited(maze, start);
 
-    // Select the exit point
-    for (row=maze_dimension_to_matrix(&maze, height)-1;row>=0;row--)
-        if (maze.a[row][cell_to_matrix_idx(&maze,width-1)] == ' ') {
-            maze.a[row][maze_dimension_to_matrix(&maze, width)-1] = ' ';
-            break;
+    while (1){
+        num_neighbs = get_available_neighbours(maze, cs, cell, neighbours);
+        checks++;
+        if (num_neighbs > 0){
+            struct cell next = neighbours[rng_next(rng)%num_neighbs];
+            remove_wall(maze, cs, cell, next);
+            // Remember the way back in the middle of the new cell
+            MAZE_AT(maze, next.y, next.x) = BACK_MARK + opposite_direction(direction_between(cell, next));
+            cell = next;
+            if (++depth > peak) peak = depth;
+        }else{
+            enum direction back;
+            if (cell.x == start.x && cell.y == start.y) break;
+            back = MAZE_AT(maze, cell.y, cell.x) - BACK_MARK;
+            mark_visited(maze, cell);
+            cell = matrix_step(cs, cell, back);
+            depth--;
         }
+    }
+    PROFILE_COUNT(COUNT_NEIGHBOUR_CHECKS, checks);
+    PROFILE_MAX(COUNT_PATH_PEAK, peak);
+}
 
-    maze.w = maze_dimension_to_matrix(&maze, maze.w);
-    maze.h = maze_dimension_to_matrix(&maze, maze.h);
-
-    // Add the potions inside the maze at three random locations
-    for (i=0;i<NEEDED_POTIONS;i++){
-        do{
-            row = random()%(maze.h-1);
-            col = random()%(maze.w-1);
-        }while (maze.a[row][col] != ' ');
-        maze.a[row][col] = POTION;
+/**
+ * Defines carve_with_stack_name and carve_in_place_name, the carving
+ * functions compiled for cell size cs.
+ */
+#define CARVE_KERNELS(name, cs) \
+    void carve_with_stack_##name(struct maze *maze, struct cell start, struct stack *stack, struct maze_rng *rng){ \
+        carve_with_stack(maze, cs, start, stack, rng); \
+    } \
+    void carve_in_place_##name(struct maze *maze, struct cell start, struct maze_rng *rng){ \
+        carve_in_place(maze, cs, start, rng); \
     }
 
-    return maze;
+CARVE_KERNELS(1, 1)
+CARVE_KERNELS(3, 3)
+CARVE_KERNELS(5, 5)
+CARVE_KERNELS(any, maze->cell_size)
+
+/**
+ * The carving functions for one cell size, 0 for any.
+ */
+struct carve_kernels{
+    unsigned int cell_size;
+    void (*with_stack)(struct maze *maze, struct cell start, struct stack *stack, struct maze_rng *rng);
+    void (*in_place)(struct maze *maze, struct cell start, struct maze_rng *rng);
+};
+
+const struct carve_kernels carve_kernels[] = {
+    {1, carve_with_stack_1, carve_in_place_1},
+    {3, carve_with_stack_3, carve_in_place_3},
+    {5, carve_with_stack_5, carve_in_place_5},
+    {0, carve_with_stack_any, carve_in_place_any}
+};
+
+/**
+ * Returns the carving functions compiled for cell_size, or the generic
+ * ones if there are none.
+ */
+const struct carve_kernels *find_carve_kernels(unsigned int cell_size){
+    const struct carve_kernels *k = carve_kernels;
+    while (k->cell_size != 0 && k->cell_size != cell_size) k++;
+    return k;
 }
 
+/**
+ * Fills the matrix of a maze of width x height cells with what carving
+ * starts from: walls around every cell, and squares open but for their
+ * middle char, which stays a wall until the cell is visited. The first
+ * row of cells is built and then copied down a whole row of cells at a
+ * time, so every char is written once, by memset and memcpy.
+ */
+void init_matrix(struct maze *maze, unsigned int height){
+    unsigned int cs = maze->cell_size, p = cs+1, k, y;
+    size_t stride = maze->stride, x;
+    char *line;
 
-void print_maze(int row, int col, struct maze my_maze, int potions){ // print the maze, ncurses only works in terminal
-    initscr();                                          // i tried using terminal emulation via the IDE but it doesn't work
-    cbreak();
-    noecho();
-    wclear(stdscr);
-    for (row = 0; row < my_maze.h; row++){
-        for(col = 0; col < my_maze.w; col++){
-            waddch(stdscr, my_maze.a[row][col]);
-        }
-    	  wmove(stdscr, row+1, col*0);
-//        printw("\n");
+    memset(maze->a, WALL, stride); // top border
+    for (k=0;k<cs;k++){
+        line = maze->a + (1+k)*stride;
+        memset(line, ' ', stride);
+        for (x=0;x<stride;x+=p) line[x] = WALL;
+        if (k == cs/2)
+            for (x=cs/2+1;x<stride;x+=p) line[x] = WALL;
     }
-    printw("Potions collected: ");
-    printw("%d", potions);
-    scrollok(stdscr, TRUE);
-    wrefresh(stdscr);
+    memset(maze->a + p*stride, WALL, stride); // wall below the first row of cells
+    for (y=1;y<height;y++)
+        memcpy(maze->a + (1+(size_t)y*p)*stride, maze->a + stride, p*stride);
 }
 
-// print_maze but with the fog mechanic
-void print_maze_fog(int row , int col, int player_coord_x, int player_coord_y, struct maze mymaze, int potions, int fog_radius) {
-    initscr();
-    cbreak();
-    noecho();
-    wclear(stdscr);
+/**
+ * Returns the WALL_EAST / WALL_SOUTH bits of cell (x, y) of a carved char
+ * matrix whose w and h still count cells, for an open_index.
+ */
+unsigned int maze_walls(const void *m, unsigned int x, unsigned int y){
+    const struct maze *maze = (const struct maze*)m;
+    unsigned int p = maze->cell_size+1;
+    unsigned int bits = 0;
+    if (x+1 == maze->w || MAZE_AT(maze, 1+y*p, (x+1)*p) == WALL) bits |= WALL_EAST;
+    if (y+1 == maze->h || MAZE_AT(maze, (y+1)*p, 1+x*p) == WALL) bits |= WALL_SOUTH;
+    return bits;
+}
+
+/**
+ * Generates the maze described by gen into an existing struct maze,
+ * reusing its memory when it is large enough. See generate_maze.
+ * With CARVE_STACK the matrix and the generator stack share one block:
+ * the matrix comes first and the stack follows it, aligned for struct cell.
+ * CARVE_BACKTRACK only needs the matrix.
+ * Returns 0 on success, -1 if the memory could not be allocated, in which
+ * case the previous content of the maze is lost but its memory is kept.
+ */
+int gen_maze(struct maze_gen *gen, struct maze *maze){
+    int i;
+    unsigned int width = gen->width, height = gen->height;
+    size_t matrix_size, scratch_size = 0;
+    struct stack stack;
+    struct cell cell;
+    struct open_index index;
+    struct item *items;
+    long num_potions;
+    PROFILE_START(walls);
+    maze->w = width;
+    maze->h = height;
+    maze->cell_size = gen->cell_size;
+    maze->stride = maze_dimension_to_matrix(maze, width);
 
-    if ((fog_radius == 0) || ((fog_radius >= mymaze.h - 1) ||
-                              (fog_radius >= mymaze.w - 1))) { // if there is no fog or the radius exceeds the maze
-        print_maze(row, col, mymaze, potions);                    // don't print it
+    matrix_size = (size_t)maze->stride*maze_dimension_to_matrix(maze, height);
+    if (gen->mode == CARVE_STACK){
+        matrix_size = (matrix_size + _Alignof(struct cell) - 1) & ~(size_t)(_Alignof(struct cell) - 1);
+        scratch_size = sizeof(struct cell)*((size_t)width*height+1);
     }
-    else if (player_coord_y >= fog_radius && player_coord_y < mymaze.h - fog_radius){
-            if (player_coord_x >= fog_radius && player_coord_x < mymaze.w - fog_radius) { // if the player is in the middle
-                for (int i = 0 - fog_radius; i <= fog_radius; i++) { //y loop
-                    for(int j = 0 - fog_radius; j <= fog_radius; j++){ // x loop
-                        wmove(stdscr, player_coord_y + i, player_coord_x + j);
-                        waddch(stdscr, mymaze.a[player_coord_y + i][player_coord_x + j]);
-                    }
-                        printw("\n");
+    if (reserve_maze(maze, matrix_size + scratch_size) != 0) return -1;
 
-                }
-            }
-            else if (player_coord_x <= fog_radius) { // if the player is on the left
-                for (int i = 0 - player_coord_x; i <= fog_radius; i++) {
-                    for(int j = 0 - player_coord_x; j <= fog_radius; j++){
-                        wmove(stdscr, player_coord_y + i, player_coord_x + j);
-                        waddch(stdscr, mymaze.a[player_coord_y + i][player_coord_x + j]);
-                    }
-                    printw("\n");
+    // Initialise RNG
+    seed_rng(&gen->rng, gen->seed);
 
-                }
-            }
-            else if(player_coord_x >= mymaze.w - fog_radius){ // if the player is on the right
-                refresh();
-                int my_var = (int)mymaze.w - player_coord_x; // the comparison didn't work without casting it
-                for (int i = 0 - fog_radius; i <= my_var - 1; i++) {
-                    for(int j = 0 - fog_radius; j <= my_var - 1; j++){
-                        wmove(stdscr, player_coord_y + i, player_coord_x + j);
-                        waddch(stdscr, mymaze.a[player_coord_y + i][player_coord_x + j]);
-                    }
-                    printw("\n");
+    // Initialise the matrix with walls and unvisited cells
+    init_matrix(maze, height);
+    PROFILE_END(PHASE_GEN_WALLS, walls);
+    PROFILE_START(carve);
 
-                }
+    // Select a random position on a border.
+    // Border means x=0 or y=0 or x=2*width+1 or y=2*height+1
+    cell.x = cell_to_matrix_idx(maze,0);
+    cell.y = cell_to_matrix_idx(maze,rng_next(&gen->rng)%height);
 
-            }
+    if (gen->mode == CARVE_STACK){
+        // Initialise stack in the scratch area behind the matrix
+        init_stack_buffer(&stack, (struct cell*)(maze->a + matrix_size), width*height);
+        find_carve_kernels(maze->cell_size)->with_stack(maze, cell, &stack, &gen->rng);
+    }else{
+        find_carve_kernels(maze->cell_size)->in_place(maze, cell, &gen->rng);
+    }
 
+    // Every cell is visited, so the first open row next to the left border
+    // is the top row of the top left cell, and the last one next to the
+    // right border the bottom row of the bottom right cell
+    MAZE_AT(maze, 1, 0) = ' ';
+    MAZE_AT(maze, maze_dimension_to_matrix(maze, height)-2, maze_dimension_to_matrix(maze, width)-1) = ' ';
+    PROFILE_END(PHASE_GEN_CARVE, carve);
 
+    // Add the potions at distinct random free chars, no more than there are
+    PROFILE_START(potions);
+    if (init_open_index(&index, width, height, maze->cell_size) != 0) return -1;
+    count_openings(&index, maze_walls, maze);
+    num_potions = open_chars(&index) < gen->num_potions ? (long)open_chars(&index) : (long)gen->num_potions;
+    if ((items = (struct item*)MAZE_MALLOC(sizeof(struct item)*((size_t)num_potions+1))) == NULL){
+        free_open_index(&index);
+        return -1;
     }
-    else if (player_coord_y <= fog_radius){ // the player is near the upper wall
-        if (player_coord_x >= fog_radius && player_coord_x < mymaze.w - fog_radius) { // if the player is in the middle
-            for (int i = 0 - player_coord_y; i <= fog_radius; i++) {
-                for(int j = 0 - fog_radius; j <= fog_radius; j++){
-                    wmove(stdscr, player_coord_y + i, player_coord_x + j);
-                    waddch(stdscr, mymaze.a[player_coord_y + i][player_coord_x + j]);
-                }
-                printw("\n");
+    num_potions = place_potions(&index, maze_walls, maze, &gen->rng, num_potions, items);
+    for (i=0;i<num_potions;i++) MAZE_AT(maze, items[i].row, items[i].col) = POTION;
+    free_open_index(&index);
+    free(items);
+    if (num_potions < 0) return -1;
+    PROFILE_END(PHASE_GEN_POTIONS, potions);
 
-            }
-        }
-        else if (player_coord_x <= fog_radius) { // if the player is on the upper left
-            for (int i = 0 - player_coord_y; i <= fog_radius; i++) {
-                for(int j = 0 - player_coord_x; j <= fog_radius; j++){
-                    wmove(stdscr, player_coord_y + i, player_coord_x + j);
-                    waddch(stdscr, mymaze.a[player_coord_y + i][player_coord_x + j]);
-                }
-                printw("\n");
+    maze->w = maze_dimension_to_matrix(maze, maze->w);
+    maze->h = maze_dimension_to_matrix(maze, maze->h);
+    return 0;
+}
+
+/**
+ * Same as generate_maze, but builds the maze into an existing struct maze,
+ * reusing its memory when it is large enough, and lets the caller pick
+ * the carve mode.
+ * Returns 0 on success, -1 if the memory could not be allocated.
+ */
+int regenerate_maze(struct maze *maze, unsigned int width, unsigned int height, unsigned int cell_size, int rand_seed, enum carve_mode mode){
+    struct maze_gen gen;
+    init_maze_gen(&gen, width, height, cell_size, rand_seed);
+    gen.mode = mode;
+    return gen_maze(&gen, maze);
+}
 
+/**
+ * This function generates a maze of width x height cells.
+ * Each cell is a square of cell_size x cell_size characters.
+ * The maze is randomly generated based on the supplied rand_seed.
+ * Use the same rand_seed value to obtain the same maze.
+ *
+ * The function returns a struct maze variable containing:
+ * - the maze represented as a row-major matrix (field a, see MAZE_AT)
+ * - the width (number of columns) of the array (field w)
+ * - the height (number of rows) of the array (field h).
+ * In the array, walls are represented with a 'w' character, while
+ * pathways are represented with spaces (' ').
+ * The edges of the array consist of walls, with the exception
+ * of two openings, one on the left side (column 0) and one on
+ * the right (column w-1) of the array. These should be used
+ * as entry and exit.
+ * The maze owns its memory, release it with free_maze.
+ * If the memory could not be allocated, field a is NULL.
+ */
+struct maze generate_maze(unsigned int width, unsigned int height, unsigned int cell_size, int rand_seed){
+    struct maze maze;
+    init_maze(&maze);
+    if (regenerate_maze(&maze, width, height, cell_size, rand_seed, CARVE_BACKTRACK) != 0)
+        free_maze(&maze);
+    return maze;
+}
 
-            }
-        }
-        else if(player_coord_x >= mymaze.w - fog_radius){ // if the player is on the upper right
-            refresh();
-            int my_var = (int)mymaze.w - player_coord_x - 1;
+//-----------------------------------------------------------------------------
 
-            for (int i = 0 - player_coord_y; i <= fog_radius; i++) {
-                for(int j = 0 - fog_radius; j <= my_var; j++){
-                    wmove(stdscr, player_coord_y + i, player_coord_x + j);
-                    waddch(stdscr, mymaze.a[player_coord_y + i][player_coord_x + j]);
-                }
-                printw("\n");
+/**
+ * Compact form of a maze. Only the walls of each cell are stored:
+ * 2 bits per cell (WALL_EAST and WALL_SOUTH), four cells per byte.
+ * The west and north walls of a cell are the east and south walls of its
+ * neighbours; the outer border is implied.
+ * Every cell row starts on an 8-byte boundary, row_bytes apart; the bits
+ * past the last cell of a row are set.
+ * The char matrix of generate_maze is never stored, packed_char_at and
+ * packed_expand_row produce any part of it on demand.
+ * The walls either belong to the maze or are a read-only mapping of a
+ * maze file (see load_packed_maze).
+ */
+struct packed_maze{
+    unsigned char *walls;
+    unsigned int w; // width in cells
+    unsigned int h; // height in cells
+    unsigned int cell_size; // number of chars per cell; walls are 1 char
+    int seed; // seed the maze was generated from
+    size_t row_bytes; // bytes used by one row of cells
+    struct item *items; // potions still lying in the maze
+    unsigned int num_items;
+    void *map; // mapping holding the walls, NULL if they were allocated
+    size_t map_size;
+};
 
+void init_packed_maze(struct packed_maze *pm){
+    pm->walls = NULL;
+    pm->w = 0;
+    pm->h = 0;
+    pm->cell_size = 0;
+    pm->seed = 0;
+    pm->row_bytes = 0;
+    pm->items = NULL;
+    pm->num_items = 0;
+    pm->map = NULL;
+    pm->map_size = 0;
+}
 
-            }
+void free_packed_maze(struct packed_maze *pm){
+    if (pm->map != NULL) munmap(pm->map, pm->map_size);
+    else free(pm->walls);
+    free(pm->items);
+    init_packed_maze(pm);
+}
 
-        }
-    }
-    else if (player_coord_y >= mymaze.h - fog_radius){ //player is on the lower wall
-        if (player_coord_x >= fog_radius && player_coord_x < mymaze.w - fog_radius) { // if the player is in the middle
-            for (int i = 0 - fog_radius; i <= (int)mymaze.h - player_coord_y - 1; i++) {
-                for(int j = 0 - fog_radius; j <= fog_radius; j++){
-                    wmove(stdscr, player_coord_y + i, player_coord_x + j);
-                    waddch(stdscr, mymaze.a[player_coord_y + i][player_coord_x + j]);
-                }
-                printw("\n");
+/**
+ * Returns the number of bytes of one row of walls for width cells.
+ */
+size_t packed_row_bytes(unsigned int width){
+    return ((size_t)width+31)/32*8;
+}
 
+/**
+ * Width of the char matrix the packed maze stands for.
+ */
+unsigned int packed_matrix_width(const struct packed_maze *pm){
+    return (pm->cell_size+1)*pm->w+1;
+}
 
-            }
-        }
-        else if (player_coord_x <= fog_radius) { // if the player is on the lower left
-            for (int i = 0 - fog_radius; i <= (int)mymaze.h - player_coord_y - 1; i++) {
-                for(int j = 0 - player_coord_x; j <= fog_radius; j++){
-                    wmove(stdscr, player_coord_y + i, player_coord_x + j);
-                    waddch(stdscr, mymaze.a[player_coord_y + i][player_coord_x + j]);
-                }
-                printw("\n");
+/**
+ * Height of the char matrix the packed maze stands for.
+ */
+unsigned int packed_matrix_height(const struct packed_maze *pm){
+    return (pm->cell_size+1)*pm->h+1;
+}
 
+/**
+ * Reads the 2-bit value of cell (x, y) from a grid laid out like
+ * packed_maze walls: four cells per byte, rows row_bytes apart.
+ */
+unsigned int grid2_get(const unsigned char *grid, size_t row_bytes, unsigned int x, unsigned int y){
+    return (grid[y*row_bytes+x/4] >> ((x%4)*2)) & 3;
+}
 
-            }
-        }
-        else if(player_coord_x >= mymaze.w - fog_radius){ // if the player is on the lower right
-            refresh();
-            int my_var = (int)mymaze.w - player_coord_x - 1;
+/**
+ * Stores the 2-bit value of cell (x, y), see grid2_get.
+ */
+void grid2_set(unsigned char *grid, size_t row_bytes, unsigned int x, unsigned int y, unsigned int value){
+    unsigned char *b = &grid[y*row_bytes+x/4];
+    *b = (*b & ~(3 << ((x%4)*2))) | (value << ((x%4)*2));
+}
 
-            for (int i = 0 - fog_radius; i <= (int)mymaze.h - player_coord_y - 1; i++) {
-                for(int j = 0 - fog_radius; j <= my_var; j++){
-                    wmove(stdscr, player_coord_y + i, player_coord_x + j);
-                    waddch(stdscr, mymaze.a[player_coord_y + i][player_coord_x + j]);
-                }
-                printw("\n");
+/**
+ * Returns the WALL_EAST / WALL_SOUTH bits of cell (x, y).
+ */
+unsigned int packed_walls(const struct packed_maze *pm, unsigned int x, unsigned int y){
+    return grid2_get(pm->walls, pm->row_bytes, x, y);
+}
 
-            }
+/**
+ * packed_walls for an open_index.
+ */
+unsigned int packed_walls_of(const void *pm, unsigned int x, unsigned int y){
+    return packed_walls((const struct packed_maze*)pm, x, y);
+}
 
+/**
+ * Fills in the counts of index from the walls of pm, 64 bits at a time:
+ * a clear bit is an opening and the padding bits are set, so a row of
+ * blocks costs one popcount per 32 cells.
+ */
+void count_packed_openings(struct open_index *index, const struct packed_maze *pm){
+    size_t words = pm->row_bytes/8, b = 0, k;
+    uint64_t n = 0, word;
+    unsigned int y;
+    for (y=0;y<pm->h;y++)
+        for (k=0;k<words;k++){
+            if (k%(OPEN_BLOCK/32) == 0) index->openings[b++] = n;
+            memcpy(&word, pm->walls + y*pm->row_bytes + k*8, 8);
+            n += __builtin_popcountll(~word);
         }
+    index->openings[b] = n;
+}
+
+/**
+ * Clears the given wall bits of cell (x, y).
+ */
+void packed_open(struct packed_maze *pm, unsigned int x, unsigned int y, unsigned int bits){
+    pm->walls[y*pm->row_bytes+x/4] &= ~(bits << ((x%4)*2));
+}
 
+/**
+ * packed_wall_char_at for cell size cs.
+ */
+KERNEL char wall_char_at(const struct packed_maze *pm, unsigned int cs, long row, long col){
+    long mw = (long)(cs+1)*pm->w+1;
+    long mh = (long)(cs+1)*pm->h+1;
+    unsigned int p = cs+1;
+    unsigned int ry, rx;
+
+    if (row < 0 || col < 0 || row >= mh || col >= mw) return WALL;
+    if (row == 1 && col == 0) return ' ';
+    if (row == mh-2 && col == mw-1) return ' ';
+    if (row == 0 || col == 0) return WALL;
+
+    ry = (row-1)%p;
+    rx = (col-1)%p;
+    if (ry < cs && rx < cs) return ' ';
+    if (ry < cs && rx == cs)
+        return (packed_walls(pm, (col-1)/p, (row-1)/p) & WALL_EAST) ? WALL : ' ';
+    if (ry == cs && rx < cs)
+        return (packed_walls(pm, (col-1)/p, (row-1)/p) & WALL_SOUTH) ? WALL : ' ';
+    return WALL;
+}
+
+/**
+ * Returns the char at (row, col) of the matrix, without items.
+ * Coordinates outside the matrix are walls.
+ * The entry is always at (1, 0) and the exit at (h-2, w-1) of the
+ * matrix: generate_maze picks the first and last open rows next to the
+ * border, which are the first row of the top left cell and the last row
+ * of the bottom right cell.
+ * The common cell sizes get their own copy of wall_char_at, where the
+ * divisions by the cell size are multiplies.
+ */
+char packed_wall_char_at(const struct packed_maze *pm, long row, long col){
+    switch (pm->cell_size){
+        case 1: return wall_char_at(pm, 1, row, col);
+        case 3: return wall_char_at(pm, 3, row, col);
+        case 5: return wall_char_at(pm, 5, row, col);
+        default: return wall_char_at(pm, pm->cell_size, row, col);
     }
+}
 
-    printw("Potions collected: ");
-    printw("%d", potions);
-    scrollok(stdscr, TRUE);
-    wrefresh(stdscr);
-    wrefresh(stdscr);
+/**
+ * Orders items by row, then column, for qsort.
+ */
+int compare_items(const void *a, const void *b){
+    const struct item *x = (const struct item*)a, *y = (const struct item*)b;
+    if (x->row != y->row) return x->row < y->row ? -1 : 1;
+    return x->col < y->col ? -1 : x->col > y->col;
 }
 
-int main() {
-    unsigned int width; // vars to ask the player
-    unsigned int height;
-    unsigned int cell_size;
-    int seed;
-    int fog_radius;
-    
-    // movement
-     enum {
-         MOVE_UP = 'w',
-         MOVE_DOWN = 's',
-         MOVE_LEFT = 'a',
-         MOVE_RIGHT = 'd'
-    };
+/**
+ * Sorts the items of pm, which find_item and packed_expand_row rely on.
+ */
+void sort_items(struct packed_maze *pm){
+    qsort(pm->items, pm->num_items, sizeof(struct item), compare_items);
+}
+
+/**
+ * Returns the index of the first item at or after (row, col) in the
+ * sorted items, num_items if there is none.
+ */
+unsigned int items_from(const struct packed_maze *pm, long row, long col){
+    unsigned int lo = 0, hi = pm->num_items;
+    while (lo < hi){
+        unsigned int mid = (lo+hi)/2;
+        if (pm->items[mid].row < row || (pm->items[mid].row == row && pm->items[mid].col < col)) lo = mid+1;
+        else hi = mid;
+    }
+    return lo;
+}
 
-    int potions_collected = 0;
+/**
+ * Returns the index of the item at (row, col), or -1 if there is none.
+ * A binary search of the sorted items.
+ */
+int find_item(const struct packed_maze *pm, long row, long col){
+    unsigned int i = items_from(pm, row, col);
+    if (i < pm->num_items && pm->items[i].row == row && pm->items[i].col == col) return i;
+    return -1;
+}
 
-    char input = 0; // user input
-    // player coordinates
-    int player_coordinate_x = 0;
-    int player_coordinate_y = 0;
+/**
+ * Removes the item at (row, col) from the maze and returns its kind,
+ * or 0 if there was no item.
+ */
+char take_item(struct packed_maze *pm, long row, long col){
+    int i = find_item(pm, row, col);
+    char kind;
+    if (i < 0) return 0;
+    kind = pm->items[i].kind;
+    pm->num_items--;
+    memmove(&pm->items[i], &pm->items[i+1], sizeof(struct item)*(pm->num_items-i));
+    return kind;
+}
 
+/**
+ * Returns the char at (row, col) of the matrix, items included.
+ */
+char packed_char_at(const struct packed_maze *pm, long row, long col){
+    int i = find_item(pm, row, col);
+    if (i >= 0) return pm->items[i].kind;
+    return packed_wall_char_at(pm, row, col);
+}
 
-    int row = 0; // variables to go through the 2d array maze
-    int col = 0;
+/**
+ * Returns whether (row, col) of the matrix blocks movement.
+ */
+int packed_is_wall(const struct packed_maze *pm, long row, long col){
+    return packed_wall_char_at(pm, row, col) == WALL;
+}
 
-    // ask the user for parameters--------------------------
-    printf("Press 'q' in maze to quit.\n");
-    printf("Enter a width: ");
-    scanf("%d", &width);
-    printf("Enter a height: ");
-    scanf("%d", &height);
-    printf("Enter size for the cell (enter an odd number): ");
-    scanf("%d", &cell_size);
-    printf("Enter a value for the seed: ");
-    scanf("%d", &seed);
-    printf("Enter a fog radius: ");
-    scanf("%d", &fog_radius);
-
-    struct maze my_maze = generate_maze(width, height, cell_size, seed); // creat a new maze
-
-    while (row < my_maze.h){ // spawn player at the first entrance row
-        if (my_maze.a[row][col] == ' '){
-            my_maze.a[row][col] = PLAYER;
-
-            player_coordinate_x = col;
-            player_coordinate_y = row;
+/**
+ * Writes n chars of matrix row row, starting at column col, into out.
+ * This is the row-at-a-time version of packed_char_at: inside the maze
+ * it steps through the cells instead of dividing for every char.
+ */
+void packed_expand_row(const struct packed_maze *pm, long row, long col, unsigned int n, char *out){
+    unsigned int p = pm->cell_size+1;
+    long mw = packed_matrix_width(pm);
+    long mh = packed_matrix_height(pm);
+    unsigned int i = 0, x, y, rx;
+    int wall_row;
 
-            break;
+    // Columns left of the first cell are border
+    for (;i<n && col+i <= 0;i++) out[i] = packed_wall_char_at(pm, row, col+i);
+
+    if (row > 0 && row < mh-1 && i < n){
+        y = (row-1)/p;
+        wall_row = (row-1)%p == pm->cell_size;
+        x = (col+i-1)/p;
+        rx = (col+i-1)%p;
+        for (;i<n && col+i < mw-1;i++){
+            if (rx < pm->cell_size)
+                out[i] = (wall_row && (packed_walls(pm, x, y) & WALL_SOUTH)) ? WALL : ' ';
+            else
+                out[i] = (wall_row || (packed_walls(pm, x, y) & WALL_EAST)) ? WALL : ' ';
+            if (++rx == p){ rx = 0; x++; }
         }
-        row ++;
     }
 
-    // print the maze for the first time
-    print_maze_fog(row, col,player_coordinate_x, player_coordinate_y, my_maze, potions_collected, fog_radius);
+    // Border rows and the columns right of the last cell
+    for (;i<n;i++) out[i] = packed_wall_char_at(pm, row, col+i);
 
+    for (i=items_from(pm, row, col);i<pm->num_items && pm->items[i].row == row && pm->items[i].col < col+n;i++)
+        out[pm->items[i].col-col] = pm->items[i].kind;
+}
 
-    while (true){ // while playing
+/**
+ * Expands the whole packed maze into the char matrix generate_maze
+ * would have produced, reusing the memory of maze.
+ * Returns 0 on success, -1 if the memory could not be allocated.
+ */
+int expand_packed_maze(const struct packed_maze *pm, struct maze *maze){
+    unsigned int row;
+    if (reserve_maze(maze, (size_t)packed_matrix_width(pm)*packed_matrix_height(pm)) != 0) return -1;
+    maze->w = packed_matrix_width(pm);
+    maze->h = packed_matrix_height(pm);
+    maze->cell_size = pm->cell_size;
+    maze->stride = maze->w;
+    for (row=0;row<maze->h;row++)
+        packed_expand_row(pm, row, 0, maze->w, &MAZE_AT(maze, row, 0));
+    return 0;
+}
 
-        input = getch(); // get a char (movement key)
+int bitmap_get(const unsigned char *bitmap, size_t i){
+    return (bitmap[i/8] >> (i%8)) & 1;
+}
 
-        switch (input) {
-            case MOVE_UP:
-                if (my_maze.a[player_coordinate_y - 1][player_coordinate_x] != 'w'){  // get movement
+void bitmap_set(unsigned char *bitmap, size_t i){
+    bitmap[i/8] |= 1 << (i%8);
+}
 
-                    if (my_maze.a[player_coordinate_y - 1][player_coordinate_x] == POTION) //if there is a potion on that spot
-                        potions_collected += 1; // pick it up
+/**
+ * A rectangle of cells: x0 <= x < x1 and y0 <= y < y1.
+ */
+struct cell_rect{
+    unsigned int x0;
+    unsigned int y0;
+    unsigned int x1;
+    unsigned int y1;
+};
 
-                    my_maze.a[player_coordinate_y][player_coordinate_x] = ' '; // replace the old coordinate with blank
-                    my_maze.a[player_coordinate_y - 1][player_coordinate_x] = PLAYER; // place the player at the new coordinate
-                    player_coordinate_y -= 1; // update the player coordinates
-                    print_maze_fog(row, col, player_coordinate_x, player_coordinate_y, my_maze, potions_collected,fog_radius); // refresh the maze
-                }
-                break;
-            case MOVE_DOWN:
-                if (my_maze.a[player_coordinate_y + 1][player_coordinate_x] != 'w'){
+/**
+ * Returns whether the carving has reached cell (x, y) of area.
+ * With a visited bitmap (one bit per cell) that is its bit. Without one,
+ * a cell counts as reached once any of its walls inside area is open.
+ * The only reached cell with all its walls up is the starting cell before
+ * the first step, and nothing asks about it then.
+ * Nothing outside area is read, so other threads may carve other areas.
+ */
+int packed_visited(const struct packed_maze *pm, const struct cell_rect *area, const unsigned char *visited, unsigned int x, unsigned int y){
+    if (visited != NULL) return bitmap_get(visited, (size_t)y*pm->w+x);
+    if (packed_walls(pm, x, y) != (WALL_EAST|WALL_SOUTH)) return 1;
+    if (x > area->x0 && !(packed_walls(pm, x-1, y) & WALL_EAST)) return 1;
+    if (y > area->y0 && !(packed_walls(pm, x, y-1) & WALL_SOUTH)) return 1;
+    return 0;
+}
+
+/**
+ * Packed counterpart of get_available_neighbours, working in cell
+ * coordinates and limited to area. visited is passed on to
+ * packed_visited.
+ * Neighbours are returned in the same order, so that the same seed
+ * carves the same maze.
+ */
+int get_packed_neighbours(const struct packed_maze *pm, const struct cell_rect *area, const unsigned char *visited, struct cell cell, struct cell *neighbours){
+    int num_neighbrs = 0;
 
-                    if (my_maze.a[player_coordinate_y + 1][player_coordinate_x] == POTION)
-                        potions_collected += 1;
+    // Check above
+    if (cell.y > area->y0 && !packed_visited(pm, area, visited, cell.x, cell.y-1)){
+        neighbours[num_neighbrs].x = cell.x;
+        neighbours[num_neighbrs].y = cell.y-1;
+        num_neighbrs ++;
+    }
 
-                    my_maze.a[player_coordinate_y][player_coordinate_x] = ' ';
-                    my_maze.a[player_coordinate_y + 1][player_coordinate_x] = PLAYER;
-                    player_coordinate_y += 1;
-                    print_maze_fog(row, col, player_coordinate_x,player_coordinate_y,my_maze, potions_collected, fog_radius);
+    // Check left
+    if (cell.x > area->x0 && !packed_visited(pm, area, visited, cell.x-1, cell.y)){
+        neighbours[num_neighbrs].x = cell.x-1;
+        neighbours[num_neighbrs].y = cell.y;
+        num_neighbrs ++;
+    }
 
-                }
-                break;
-            case MOVE_LEFT:
-                if (my_maze.a[player_coordinate_y][player_coordinate_x - 1] != 'w'
-                && (player_coordinate_x - 1) < my_maze.w){
+    // Check right
+    if (cell.x < area->x1-1 && !packed_visited(pm, area, visited, cell.x+1, cell.y)){
+        neighbours[num_neighbrs].x = cell.x+1;
+        neighbours[num_neighbrs].y = cell.y;
+        num_neighbrs ++;
+    }
 
-                    if (my_maze.a[player_coordinate_y][player_coordinate_x - 1] == POTION)
-                        potions_collected += 1;
+    // Check below
+    if (cell.y < area->y1-1 && !packed_visited(pm, area, visited, cell.x, cell.y+1)){
+        neighbours[num_neighbrs].x = cell.x;
+        neighbours[num_neighbrs].y = cell.y+1;
+        num_neighbrs ++;
+    }
 
-                    my_maze.a[player_coordinate_y][player_coordinate_x] = ' ';
-                    my_maze.a[player_coordinate_y][player_coordinate_x - 1] = PLAYER;
-                    player_coordinate_x -= 1;
-                    print_maze_fog(row, col, player_coordinate_x, player_coordinate_y, my_maze, potions_collected,fog_radius);
+    return num_neighbrs;
+}
 
-                }
-                break;
-            case MOVE_RIGHT:
-                if (my_maze.a[player_coordinate_y][player_coordinate_x + 1] != 'w'
-                && (player_coordinate_x + 1) < my_maze.w){
-
-                    if (my_maze.a[player_coordinate_y][player_coordinate_x + 1] == POTION)
-                        potions_collected += 1;
-
-                    my_maze.a[player_coordinate_y][player_coordinate_x] = ' ';
-                    my_maze.a[player_coordinate_y][player_coordinate_x + 1] = PLAYER;
-                    player_coordinate_x += 1;
-                    print_maze_fog(row, col,player_coordinate_x, player_coordinate_y, my_maze, potions_collected,fog_radius);
-
-                    // check can the player exit
-                    if (player_coordinate_x + 1 == my_maze.w){ // player exit
-                        if (potions_collected == NEEDED_POTIONS){
-                            clear();
-                            refresh();
-                            printw("You have escaped the maze! Press any key to exit.");
-                            getch();
-                            endwin();
-                            return 0;
-                        } else { // player cannot exit
-                            refresh();
-                            printw("\nYou cannot exit before collecting all the potions!");
-                        }
-                    }
-                }
-                break;
-            case 'q':  // quit the game at any time
-                endwin();
-                return 0;
-            default: // shouldn't be able to get there
-                break;
+/**
+ * Removes the wall between two adjacent cells, given in cell coordinates.
+ */
+void packed_remove_wall(struct packed_maze *pm, struct cell a, struct cell b){
+    if (a.y == b.y)
+        packed_open(pm, a.x < b.x ? a.x : b.x, a.y, WALL_EAST);
+    else
+        packed_open(pm, a.x, a.y < b.y ? a.y : b.y, WALL_SOUTH);
+}
+
+/**
+ * Returns the cell next to c in direction d, in cell coordinates.
+ */
+struct cell cell_step(struct cell c, enum direction d){
+    switch (d){
+        case DIR_UP: c.y --; break;
+        case DIR_LEFT: c.x --; break;
+        case DIR_RIGHT: c.x ++; break;
+        case DIR_DOWN: c.y ++; break;
+    }
+    return c;
+}
+
+/**
+ * Packed counterpart of carve_with_stack.
+ */
+void carve_packed_with_stack(struct packed_maze *pm, struct cell start, struct stack *stack, unsigned char *visited, struct maze_rng *rng){
+    struct cell_rect area = {0, 0, pm->w, pm->h};
+    struct cell cell;
+    struct cell neighbours[4];  // to hold neighbours of a cell
+    int num_neighbs;
+    unsigned long checks = 0, peak = 1;
+
+    bitmap_set(visited, (size_t)start.y*pm->w+start.x);
+    stack_push(stack, start);
+
+    while (! stack_isempty(stack)){
+        cell = stack_pop(stack);
+        num_neighbs = get_packed_neighbours(pm, &area, visited, cell, neighbours);
+        checks++;
+        if (num_neighbs > 0){
+            struct cell next;
+            stack_push(stack, cell);
+            next = neighbours[rng_next(rng)%num_neighbs];
+            bitmap_set(visited, (size_t)next.y*pm->w+next.x);
+            packed_remove_wall(pm, cell, next);
+            stack_push(stack, next);
+            if (stack->top_of_stack > peak) peak = stack->top_of_stack;
         }
+    }
+    PROFILE_COUNT(COUNT_NEIGHBOUR_CHECKS, checks);
+    PROFILE_MAX(COUNT_PATH_PEAK, peak);
+}
 
+/**
+ * Packed counterpart of carve_in_place, limited to the cells of area.
+ * The walls have no room for the way back, so it goes into back, a 2-bit
+ * grid with the same layout as the walls (see grid2_get). Visited cells
+ * are told apart by their open walls.
+ */
+void carve_packed_in_place(struct packed_maze *pm, const struct cell_rect *area, struct cell start, unsigned char *back, struct maze_rng *rng){
+    struct cell cell = start;
+    struct cell neighbours[4];  // to hold neighbours of a cell
+    int num_neighbs;
+    unsigned long checks = 0, depth = 1, peak = 1;
 
+    while (1){
+        num_neighbs = get_packed_neighbours(pm, area, NULL, cell, neighbours);
+        checks++;
+        if (num_neighbs > 0){
+            struct cell next = neighbours[rng_next(rng)%num_neighbs];
+            packed_remove_wall(pm, cell, next);
+            grid2_set(back, pm->row_bytes, next.x, next.y, opposite_direction(direction_between(cell, next)));
+            cell = next;
+            if (++depth > peak) peak = depth;
+        }else{
+            if (cell.x == start.x && cell.y == start.y) break;
+            cell = cell_step(cell, grid2_get(back, pm->row_bytes, cell.x, cell.y));
+            depth--;
+        }
     }
+    PROFILE_COUNT(COUNT_NEIGHBOUR_CHECKS, checks);
+    PROFILE_MAX(COUNT_PATH_PEAK, peak);
 }
 
+struct tiled_carve_args{
+    struct packed_maze *pm;
+    unsigned char *back;
+    unsigned int tile_size;
+    unsigned int tiles_x;
+    int seed;
+};
+
+/**
+ * Returns the cells of tile t, tiles being numbered row by row.
+ */
+struct cell_rect tile_area(const struct tiled_carve_args *args, size_t t){
+    struct cell_rect area;
+    area.x0 = t%args->tiles_x*args->tile_size;
+    area.y0 = t/args->tiles_x*args->tile_size;
+    area.x1 = area.x0+args->tile_size < args->pm->w ? area.x0+args->tile_size : args->pm->w;
+    area.y1 = area.y0+args->tile_size < args->pm->h ? area.y0+args->tile_size : args->pm->h;
+    return area;
+}
+
+void carve_tile(void *p, size_t t){
+    struct tiled_carve_args *args = (struct tiled_carve_args*)p;
+    struct cell_rect area = tile_area(args, t);
+    struct maze_rng rng;
+    struct cell start;
+
+    seed_rng(&rng, derive_seed(args->seed, area.x0, area.y0));
+    start.x = area.x0;
+    start.y = area.y0+rng_next(&rng)%(area.y1-area.y0);
+    carve_packed_in_place(args->pm, &area, start, args->back, &rng);
+}
+
+/**
+ * Carves pm as a grid of square tiles, each a perfect maze of its own
+ * carved on its own thread, then joins them: the borders between tiles
+ * are taken in a shuffled order and, Kruskal style, each border between
+ * two tiles not yet connected gets one opening. The tiles form a spanning
+ * tree, so the whole maze is still perfect.
+ * The tile size is rounded up to a multiple of 4 so that tiles never
+ * share a byte of walls. Every tile is seeded from gen->seed and its
+ * position, and the join uses gen->rng, so the maze only depends on the
+ * seed and the tile size, not on the number of threads.
+ * back is the 2-bit scratch grid of carve_packed_in_place.
+ * Returns 0 on success, -1 if the memory could not be allocated.
+ */
+int carve_packed_tiled(struct maze_gen *gen, struct packed_maze *pm, unsigned char *back){
+    struct tiled_carve_args args;
+    unsigned int tiles_y, num_tiles, num_borders, i, j, t, a, b;
+    unsigned int *borders, *parent;
+    struct cell_rect area;
+    unsigned int side = pm->w > pm->h ? pm->w : pm->h; // a bigger tile is the same single tile
+
+    args.pm = pm;
+    args.back = back;
+    args.tile_size = ((gen->tile_size < side ? gen->tile_size : side)+3) & ~3u;
+    args.tiles_x = (pm->w+args.tile_size-1)/args.tile_size;
+    args.seed = gen->seed;
+    tiles_y = (pm->h+args.tile_size-1)/args.tile_size;
+    num_tiles = args.tiles_x*tiles_y;
+
+    // Border 2*t is the one east of tile t, 2*t+1 the one south of it
+    borders = (unsigned int*)MAZE_MALLOC(sizeof(unsigned int)*2*num_tiles);
+    parent = (unsigned int*)MAZE_MALLOC(sizeof(unsigned int)*num_tiles);
+    if (borders == NULL || parent == NULL){
+        free(borders);
+        free(parent);
+        return -1;
+    }
+
+    parallel_for(num_tiles, gen->threads, carve_tile, &args);
+
+    num_borders = 0;
+    for (t=0;t<num_tiles;t++){
+        parent[t] = t;
+        if (t%args.tiles_x < args.tiles_x-1) borders[num_borders++] = 2*t;
+        if (t/args.tiles_x < tiles_y-1) borders[num_borders++] = 2*t+1;
+    }
+    for (i=num_borders;i>1;i--){
+        unsigned int tmp;
+        j = rng_next(&gen->rng)%i;
+        tmp = borders[i-1];
+        borders[i-1] = borders[j];
+        borders[j] = tmp;
+    }
+
+    for (i=0;i<num_borders;i++){
+        t = borders[i]/2;
+        a = uf_find(parent, t);
+        b = uf_find(parent, borders[i]%2 ? t+args.tiles_x : t+1);
+        if (a == b) continue;
+        parent[a] = b;
+        area = tile_area(&args, t);
+        if (borders[i]%2)
+            packed_open(pm, area.x0+rng_next(&gen->rng)%(area.x1-area.x0), area.y1-1, WALL_SOUTH);
+        else
+            packed_open(pm, area.x1-1, area.y0+rng_next(&gen->rng)%(area.y1-area.y0), WALL_EAST);
+    }
+
+    free(borders);
+    free(parent);
+    return 0;
+}
+
+/**
+ * Generates the same maze as generate_maze, with the same parameters and
+ * seed, directly in packed form. The char matrix is never built, so the
+ * maze takes packed_row_bytes(width)*height bytes plus the item table.
+ * While carving, CARVE_BACKTRACK needs as much again for the way back,
+ * CARVE_STACK needs 8 bytes and one bit per cell.
+ * With a tile_size, the maze is carved in parallel by carve_packed_tiled
+ * instead. It is a different maze than the one-piece carve gives for the
+ * same seed, but just as reproducible.
+ * cell_size must be odd: with an even cell size remove_wall misses the
+ * north and west walls, and generate_maze gives a different maze.
+ * Any previous content of pm is released.
+ * Returns 0 on success, -1 if the memory could not be allocated.
+ */
+int gen_packed_maze(struct maze_gen *gen, struct packed_maze *pm){
+    unsigned int width = gen->width, height = gen->height;
+    struct cell_rect area = {0, 0, width, height};
+    int use_stack = gen->mode == CARVE_STACK && gen->tile_size == 0;
+    struct stack stack;
+    struct cell cell;
+    struct open_index index;
+    int result = 0;
+    long num_potions;
+    unsigned char *scratch;
+    PROFILE_START(walls);
+
+    free_packed_maze(pm);
+    pm->w = width;
+    pm->h = height;
+    pm->cell_size = gen->cell_size;
+    pm->seed = gen->seed;
+    pm->row_bytes = packed_row_bytes(width);
+    pm->walls = (unsigned char*)MAZE_MALLOC(pm->row_bytes*height);
+    stack.cell_list = NULL;
+    if (use_stack){
+        scratch = (unsigned char*)MAZE_CALLOC((size_t)width*height/8+1, 1);  // visited bits
+        init_stack(&stack, width*height);
+    }else{
+        scratch = (unsigned char*)MAZE_MALLOC(pm->row_bytes*height);  // way back
+    }
+    if (pm->walls == NULL || scratch == NULL || (use_stack && stack.cell_list == NULL)){
+        free(scratch);
+        free_stack(&stack);
+        free_packed_maze(pm);
+        return -1;
+    }
+
+    // Every cell starts with its east and south walls
+    memset(pm->walls, 0xff, pm->row_bytes*height);
+    PROFILE_END(PHASE_GEN_WALLS, walls);
+    PROFILE_START(carve);
+
+    seed_rng(&gen->rng, gen->seed);
+
+    if (gen->tile_size > 0){
+        result = carve_packed_tiled(gen, pm, scratch);
+    }else{
+        cell.x = 0;
+        cell.y = rng_next(&gen->rng)%height;
+        if (use_stack)
+            carve_packed_with_stack(pm, cell, &stack, scratch, &gen->rng);
+        else
+            carve_packed_in_place(pm, &area, cell, scratch, &gen->rng);
+    }
+
+    free(scratch);
+    free_stack(&stack);
+    PROFILE_END(PHASE_GEN_CARVE, carve);
+    PROFILE_START(potions);
+    if (result == 0) result = init_open_index(&index, width, height, pm->cell_size);
+    if (result != 0){
+        free_packed_maze(pm);
+        return -1;
+    }
+
+    // Same potion draws as generate_maze, tested against the packed walls
+    count_packed_openings(&index, pm);
+    num_potions = open_chars(&index) < gen->num_potions ? (long)open_chars(&index) : (long)gen->num_potions;
+    if ((pm->items = (struct item*)MAZE_MALLOC(sizeof(struct item)*((size_t)num_potions+1))) == NULL){
+        free_open_index(&index);
+        free_packed_maze(pm);
+        return -1;
+    }
+    num_potions = place_potions(&index, packed_walls_of, pm, &gen->rng, num_potions, pm->items);
+    free_open_index(&index);
+    if (num_potions < 0){
+        free_packed_maze(pm);
+        return -1;
+    }
+    pm->num_items = num_potions;
+    sort_items(pm);
+    PROFILE_END(PHASE_GEN_POTIONS, potions);
+    return 0;
+}
+
+/**
+ * Shorthand for gen_packed_maze with a generator made from the arguments.
+ */
+int generate_packed_maze(struct packed_maze *pm, unsigned int width, unsigned int height, unsigned int cell_size, int rand_seed, enum carve_mode mode){
+    struct maze_gen gen;
+    init_maze_gen(&gen, width, height, cell_size, rand_seed);
+    gen.mode = mode;
+    return gen_packed_maze(&gen, pm);
+}
+
+//-----------------------------------------------------------------------------
+
+/**
+ * One maze of a batch.
+ */
+struct maze_job{
+    unsigned int width;
+    unsigned int height;
+    unsigned int cell_size;
+    int seed;
+};
+
+struct batch_args{
+    const struct maze_job *jobs;
+    struct packed_maze *mazes;
+    atomic_int failed;
+};
+
+void generate_batch_job(void *p, size_t i){
+    struct batch_args *args = (struct batch_args*)p;
+    struct maze_gen gen;
+    init_maze_gen(&gen, args->jobs[i].width, args->jobs[i].height, args->jobs[i].cell_size, args->jobs[i].seed);
+    if (gen_packed_maze(&gen, &args->mazes[i]) != 0)
+        atomic_store(&args->failed, 1);
+}
+
+/**
+ * Generates the packed maze of every job, jobs[i] into mazes[i], spread
+ * over up to threads threads (0 means one per processor).
+ * Every maze only depends on its own job, so the result is the same
+ * whatever the number of threads.
+ * mazes must hold n initialised packed mazes; their previous content is
+ * released.
+ * Returns 0 on success, -1 if some maze could not be allocated (that
+ * maze is left empty).
+ */
+int generate_maze_batch(const struct maze_job *jobs, struct packed_maze *mazes, size_t n, unsigned int threads){
+    struct batch_args args;
+    args.jobs = jobs;
+    args.mazes = mazes;
+    atomic_init(&args.failed, 0);
+    parallel_for(n, threads, generate_batch_job, &args);
+    return atomic_load(&args.failed) ? -1 : 0;
+}
+
+//-----------------------------------------------------------------------------
+
+/**
+ * Orders uint64_t ranks, for qsort.
+ */
+int compare_ranks(const void *a, const void *b){
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Writes one matrix row to out, followed by a newline, placing a potion
+ * on every free char whose rank (counting free chars from the start of
+ * the matrix, entry and exit excluded) is next in ranks.
+ * *seen is the number of free chars written so far, *next the index of
+ * the next rank to place.
+ */
+int stream_row(FILE *out, char *line, unsigned int n, long row, long mh, const uint64_t *ranks, unsigned int num_ranks, uint64_t *seen, unsigned int *next){
+    unsigned int col;
+    for (col=0;col<n && *next<num_ranks;col++){
+        if (line[col] != ' ') continue;
+        if ((row == 1 && col == 0) || (row == mh-2 && col == n-1)) continue;
+        if (*seen == ranks[*next]){
+            line[col] = POTION;
+            (*next) ++;
+        }
+        (*seen) ++;
+    }
+    line[n] = '\n';
+    return fwrite(line, 1, n+1, out) == n+1 ? 0 : -1;
+}
+
+/**
+ * Writes a maze of width x height cells to out as it is generated, one
+ * matrix row per line, in the same 'w' / ' ' / POTION layout and with the
+ * same entry and exit as generate_maze.
+ * It uses Eller's algorithm, which only ever needs the current row of
+ * cells: memory is O(width) whatever the height, so mazes far bigger than
+ * RAM can be piped into other tools. It is a different algorithm, so the
+ * maze differs from generate_maze for the same seed.
+ *
+ * Eller keeps a set label per cell of the current row; cells with the
+ * same label are already connected through earlier rows. Adjacent cells
+ * of different sets are joined at random, then every set drops at least
+ * one passage to the next row; cells not reached from above start new
+ * sets. The last row joins every set left. Labels are reused from row to
+ * row so that they stay below width.
+ *
+ * A perfect maze of n cells has exactly n-1 openings, so the number of
+ * free chars is known before the first row is written. The ranks of the
+ * num_potions potions are drawn up front and the potions dropped as
+ * those chars go by, which gives the same uniform placement as sampling
+ * a finished matrix.
+ * Returns 0 on success, -1 on allocation or write errors.
+ */
+int stream_maze(FILE *out, unsigned int width, unsigned int height, unsigned int cell_size, int seed, unsigned int num_potions){
+    struct maze_rng rng;
+    unsigned int p = cell_size+1;
+    unsigned int mw = p*width+1;
+    long mh = (long)p*height+1;
+    unsigned int *label, *parent, *count, *free_labels;
+    unsigned char *east, *south, *went_down;
+    char *line, *block;
+    unsigned int x, y, k, num_free;
+    uint64_t cells = (uint64_t)width*height;
+    uint64_t free_chars = cells*cell_size*cell_size+(cells-1)*cell_size;
+    uint64_t *ranks, seen = 0;
+    unsigned int num_ranks = free_chars < num_potions ? free_chars : num_potions;
+    unsigned int next_rank = 0;
+    long row = 0;
+    int result = 0;
+
+    // All the state lives in one block, O(width), but for the potions
+    block = (char*)MAZE_MALLOC(sizeof(unsigned int)*4*width+3*width+mw+1);
+    ranks = (uint64_t*)MAZE_MALLOC(sizeof(uint64_t)*((size_t)num_ranks+1));
+    if (block == NULL || ranks == NULL){
+        free(block);
+        free(ranks);
+        return -1;
+    }
+    label = (unsigned int*)block;
+    parent = label+width;
+    count = parent+width;
+    free_labels = count+width;
+    east = (unsigned char*)(free_labels+width);
+    south = east+width;
+    went_down = south+width;
+    line = (char*)(went_down+width);
+
+    seed_rng(&rng, seed);
+
+    // Distinct potion ranks, in the order the rows go by
+    if (sample_ranks(&rng, free_chars, ranks, num_ranks) != 0){
+        free(block);
+        free(ranks);
+        return -1;
+    }
+    qsort(ranks, num_ranks, sizeof(uint64_t), compare_ranks);
+
+    // All labels free, no cell in a set yet
+    for (x=0;x<width;x++){
+        label[x] = width;
+        free_labels[x] = width-1-x;
+    }
+    num_free = width;
+
+    // Top border
+    memset(line, WALL, mw);
+    result = stream_row(out, line, mw, row++, mh, ranks, num_ranks, &seen, &next_rank);
+
+    for (y=0;y<height && result == 0;y++){
+        int last = y == height-1;
+
+        // Cells not reached from above start a set of their own
+        for (x=0;x<width;x++){
+            if (label[x] == width) label[x] = free_labels[--num_free];
+            parent[label[x]] = label[x];
+        }
+
+        // Join adjacent cells of different sets
+        for (x=0;x<width;x++){
+            east[x] = 1;
+            if (x < width-1){
+                unsigned int a = uf_find(parent, label[x]);
+                unsigned int b = uf_find(parent, label[x+1]);
+                if (a != b && (last || rng_next(&rng)%2)){
+                    parent[b] = a;
+                    east[x] = 0;
+                }
+            }
+        }
+
+        // Every set goes down at least once: the last cell of a set that
+        // has not gone down yet always does
+        for (x=0;x<width;x++){
+            label[x] = uf_find(parent, label[x]);
+            count[label[x]] = 0;
+            went_down[label[x]] = 0;
+        }
+        for (x=0;x<width;x++) count[label[x]] ++;
+        for (x=0;x<width;x++){
+            unsigned int l = label[x];
+            int down = !last && (rng_next(&rng)%2 || (count[l] == 1 && !went_down[l]));
+            count[l] --;
+            if (down) went_down[l] = 1;
+            south[x] = !down;
+        }
+
+        // Rows of cells
+        for (k=0;k<cell_size && result == 0;k++){
+            line[0] = WALL;
+            if (y == 0 && k == 0) line[0] = ' ';  // entry
+            for (x=0;x<width;x++){
+                memset(line+p*x+1, ' ', cell_size);
+                line[p*(x+1)] = east[x] ? WALL : ' ';
+            }
+            if (last && k == cell_size-1) line[mw-1] = ' ';  // exit
+            result = stream_row(out, line, mw, row++, mh, ranks, num_ranks, &seen, &next_rank);
+        }
+
+        // Row of south walls
+        memset(line, WALL, mw);
+        for (x=0;x<width;x++)
+            if (!south[x]) memset(line+p*x+1, ' ', cell_size);
+        if (result == 0) result = stream_row(out, line, mw, row++, mh, ranks, num_ranks, &seen, &next_rank);
+
+        // Sets that went down keep their label, the other labels are free again
+        for (x=0;x<width;x++) went_down[x] = 0;
+        for (x=0;x<width;x++){
+            if (south[x]) label[x] = width;
+            else went_down[label[x]] = 1;
+        }
+        num_free = 0;
+        for (x=0;x<width;x++)
+            if (!went_down[x]) free_labels[num_free++] = x;
+    }
+    if (result == 0 && fflush(out) != 0) result = -1;
+
+    free(block);
+    free(ranks);
+    return result;
+}
+
+//-----------------------------------------------------------------------------
+
+#define MAZE_FILE_MAGIC "MAZE"
+#define MAZE_FILE_VERSION 1
+#define MAZE_FILE_ALIGN 4096 // walls start on a page boundary so they can be mapped
+
+/**
+ * Header at the start of a maze file, in the byte order of the machine
+ * that wrote it (a reader with another byte order sees a wrong version).
+ * It is followed by num_items struct maze_file_item, then, from
+ * walls_offset, height rows of row_bytes bytes of walls laid out exactly
+ * like packed_maze walls.
+ */
+struct maze_file_header{
+    char magic[4];
+    uint32_t version;
+    uint32_t width; // in cells
+    uint32_t height; // in cells
+    uint32_t cell_size;
+    int32_t seed;
+    uint32_t entry_row; // matrix coordinates of the entry and the exit
+    uint32_t entry_col;
+    uint32_t exit_row;
+    uint32_t exit_col;
+    uint32_t num_items;
+    uint32_t row_bytes;
+    uint64_t walls_offset;
+};
+
+struct maze_file_item{
+    uint32_t row;
+    uint32_t col;
+    uint32_t kind;
+};
+
+/**
+ * Writes the packed maze to path in the maze file format.
+ * Returns 0 on success, -1 on error.
+ */
+int save_packed_maze(const struct packed_maze *pm, const char *path){
+    struct maze_file_header header;
+    struct maze_file_item item;
+    FILE *f;
+    unsigned int i;
+    long pos;
+    int result = 0;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MAZE_FILE_MAGIC, 4);
+    header.version = MAZE_FILE_VERSION;
+    header.width = pm->w;
+    header.height = pm->h;
+    header.cell_size = pm->cell_size;
+    header.seed = pm->seed;
+    header.entry_row = 1;
+    header.entry_col = 0;
+    header.exit_row = packed_matrix_height(pm)-2;
+    header.exit_col = packed_matrix_width(pm)-1;
+    header.num_items = pm->num_items;
+    header.row_bytes = pm->row_bytes;
+    header.walls_offset = (sizeof(header)+sizeof(item)*pm->num_items+MAZE_FILE_ALIGN-1)/MAZE_FILE_ALIGN*MAZE_FILE_ALIGN;
+
+    f = fopen(path, "wb");
+    if (f == NULL) return -1;
+    if (fwrite(&header, sizeof(header), 1, f) != 1) result = -1;
+    for (i=0;i<pm->num_items && result == 0;i++){
+        item.row = pm->items[i].row;
+        item.col = pm->items[i].col;
+        item.kind = pm->items[i].kind;
+        if (fwrite(&item, sizeof(item), 1, f) != 1) result = -1;
+    }
+    for (pos=ftell(f);result == 0 && pos < (long)header.walls_offset;pos++)
+        if (fputc(0, f) == EOF) result = -1;
+    if (result == 0 && fwrite(pm->walls, pm->row_bytes, pm->h, f) != pm->h) result = -1;
+    if (fclose(f) != 0) result = -1;
+    return result;
+}
+
+/**
+ * Loads a maze file written by save_packed_maze into pm, releasing its
+ * previous content.
+ * The walls are not read: the file is mapped read-only and shared, so
+ * loading takes the same time for any size, pages are only read when
+ * used, and all processes with the same maze open share them.
+ * Only the item table is copied, since potions get picked up.
+ * Returns 0 on success, -1 if the file cannot be read, is not a maze
+ * file this version understands or describes a maze that cannot exist.
+ */
+int load_packed_maze(struct packed_maze *pm, const char *path){
+    struct maze_file_header header;
+    const struct maze_file_item *items;
+    struct stat st;
+    unsigned char *map;
+    unsigned int i;
+    int fd;
+
+    free_packed_maze(pm);
+    fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(header)){
+        close(fd);
+        return -1;
+    }
+    map = (unsigned char*)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+
+    memcpy(&header, map, sizeof(header));
+    if (memcmp(header.magic, MAZE_FILE_MAGIC, 4) != 0 || header.version != MAZE_FILE_VERSION
+        || check_maze_size(header.width, header.height, header.cell_size) != 0
+        || header.row_bytes != packed_row_bytes(header.width)
+        || header.walls_offset % MAZE_FILE_ALIGN != 0
+        || header.walls_offset < sizeof(header)+sizeof(struct maze_file_item)*(uint64_t)header.num_items
+        || header.walls_offset > (uint64_t)st.st_size
+        || (uint64_t)header.row_bytes*header.height > (uint64_t)st.st_size-header.walls_offset){
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    pm->w = header.width;
+    pm->h = header.height;
+    pm->cell_size = header.cell_size;
+    pm->seed = header.seed;
+    pm->row_bytes = header.row_bytes;
+    pm->walls = map+header.walls_offset;
+    pm->map = map;
+    pm->map_size = st.st_size;
+    // Entry and exit are where packed_wall_char_at expects them
+    if (header.entry_row != 1 || header.entry_col != 0
+        || header.exit_row != packed_matrix_height(pm)-2 || header.exit_col != packed_matrix_width(pm)-1){
+        free_packed_maze(pm);
+        return -1;
+    }
+
+    pm->items = (struct item*)MAZE_MALLOC(sizeof(struct item)*(header.num_items > 0 ? header.num_items : 1));
+    if (pm->items == NULL){
+        free_packed_maze(pm);
+        return -1;
+    }
+    items = (const struct maze_file_item*)(map+sizeof(header));
+    pm->num_items = header.num_items;
+    for (i=0;i<header.num_items;i++){
+        // Items are potions in open matrix chars, as place_potions puts them
+        if (items[i].kind != POTION || items[i].row >= packed_matrix_height(pm) || items[i].col >= packed_matrix_width(pm)
+            || packed_is_wall(pm, items[i].row, items[i].col)){
+            free_packed_maze(pm);
+            return -1;
+        }
+        pm->items[i].row = items[i].row;
+        pm->items[i].col = items[i].col;
+        pm->items[i].kind = items[i].kind;
+    }
+    sort_items(pm);
+    for (i=1;i<pm->num_items;i++){ // find_item expects one item per char
+        if (pm->items[i].row == pm->items[i-1].row && pm->items[i].col == pm->items[i-1].col){
+            free_packed_maze(pm);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+
+/**
+ * What a solver found and what it cost: the length of the shortest path
+ * between two cells in steps from cell to cell, the cells it took out of
+ * its frontier and the bytes it allocated.
+ */
+struct solve_stats{
+    uint64_t length; // NO_PATH if the cells are not connected
+    uint64_t expanded;
+    size_t memory;
+};
+
+#define NO_PATH UINT64_MAX
+
+/**
+ * Returns whether cell (x, y) is open towards its neighbour in direction d.
+ */
+int cell_open(const struct packed_maze *pm, unsigned int x, unsigned int y, enum direction d){
+    switch (d){
+        case DIR_UP: return y > 0 && !(packed_walls(pm, x, y-1) & WALL_SOUTH);
+        case DIR_LEFT: return x > 0 && !(packed_walls(pm, x-1, y) & WALL_EAST);
+        case DIR_RIGHT: return x+1 < pm->w && !(packed_walls(pm, x, y) & WALL_EAST);
+        default: return y+1 < pm->h && !(packed_walls(pm, x, y) & WALL_SOUTH);
+    }
+}
+
+/**
+ * Index of the neighbour in direction d of the cell of index i.
+ * Cells are indexed row by row, y*w+x.
+ */
+uint32_t cell_neighbour(const struct packed_maze *pm, uint32_t i, enum direction d){
+    switch (d){
+        case DIR_UP: return i - pm->w;
+        case DIR_LEFT: return i - 1;
+        case DIR_RIGHT: return i + 1;
+        default: return i + pm->w;
+    }
+}
+
+/**
+ * Returns the direction from cell index a to the adjacent cell index b.
+ */
+enum direction index_direction(uint32_t a, uint32_t b){
+    if (b == a+1) return DIR_RIGHT;
+    if (b + 1 == a) return DIR_LEFT;
+    return b > a ? DIR_DOWN : DIR_UP;
+}
+
+/**
+ * FIFO of cell indices, a ring buffer that doubles when full.
+ */
+struct cell_queue{
+    uint32_t *a;
+    size_t head; // index of the oldest element
+    size_t size;
+    size_t capacity;
+};
+
+void init_cell_queue(struct cell_queue *q){
+    q->a = NULL;
+    q->head = 0;
+    q->size = 0;
+    q->capacity = 0;
+}
+
+void free_cell_queue(struct cell_queue *q){
+    free(q->a);
+    init_cell_queue(q);
+}
+
+/**
+ * Returns 0 on success, -1 if out of memory.
+ */
+int queue_push(struct cell_queue *q, uint32_t i){
+    if (q->size == q->capacity){
+        size_t capacity = q->capacity ? q->capacity*2 : 1024;
+        uint32_t *a = MAZE_MALLOC(capacity*sizeof(*a));
+        size_t k;
+        if (a == NULL) return -1;
+        for (k=0;k<q->size;k++) a[k] = q->a[(q->head+k)%q->capacity];
+        free(q->a);
+        q->a = a;
+        q->head = 0;
+        q->capacity = capacity;
+    }
+    q->a[(q->head+q->size)%q->capacity] = i;
+    q->size++;
+    return 0;
+}
+
+uint32_t queue_pop(struct cell_queue *q){
+    uint32_t i = q->a[q->head];
+    q->head = (q->head+1)%q->capacity;
+    q->size--;
+    return i;
+}
+
+/**
+ * Number of cells of pm, or 0 if they do not all fit a uint32_t index.
+ */
+uint32_t num_cells(const struct packed_maze *pm){
+    uint64_t n = (uint64_t)pm->w*pm->h;
+    return n < UINT32_MAX ? n : 0;
+}
+
+/**
+ * Returns the number of steps from cell i to root following parent, the
+ * directions back to root left by a search (see bfs_cells).
+ */
+uint64_t parent_depth(const struct packed_maze *pm, const unsigned char *parent, uint32_t i, uint32_t root){
+    uint64_t n = 0;
+    while (i != root){
+        i = cell_neighbour(pm, i, grid2_get(parent, pm->row_bytes, i%pm->w, i/pm->w));
+        n++;
+    }
+    return n;
+}
+
+/**
+ * Breadth-first search of the cells from cell from, stopping when cell
+ * to is reached (UINT32_MAX to reach every cell). visited, one zeroed
+ * bit per cell, gets the reached cells. parent, laid out like the walls,
+ * gets for every reached cell the direction of the step back towards
+ * from, so the 2 bits of the walls are all a path costs.
+ * Returns 0 on success, -1 if out of memory.
+ */
+int bfs_cells(const struct packed_maze *pm, uint32_t from, uint32_t to, unsigned char *visited, unsigned char *parent, struct solve_stats *stats){
+    struct cell_queue queue;
+    int d;
+
+    init_cell_queue(&queue);
+    bitmap_set(visited, from);
+    if (queue_push(&queue, from) != 0) return -1;
+    while (queue.size > 0){
+        uint32_t i = queue_pop(&queue);
+        unsigned int x = i%pm->w, y = i/pm->w;
+        stats->expanded++;
+        if (i == to) break;
+        for (d = DIR_UP; d <= DIR_DOWN; d++){
+            uint32_t next;
+            if (!cell_open(pm, x, y, d)) continue;
+            next = cell_neighbour(pm, i, d);
+            if (bitmap_get(visited, next)) continue;
+            bitmap_set(visited, next);
+            grid2_set(parent, pm->row_bytes, next%pm->w, next/pm->w, opposite_direction(d));
+            if (queue_push(&queue, next) != 0){
+                free_cell_queue(&queue);
+                return -1;
+            }
+        }
+    }
+    stats->memory += queue.capacity*sizeof(*queue.a);
+    free_cell_queue(&queue);
+    return 0;
+}
+
+/**
+ * Breadth-first search.
+ */
+int solve_bfs(const struct packed_maze *pm, uint32_t from, uint32_t to, struct solve_stats *stats){
+    size_t visited_size = ((size_t)num_cells(pm)+7)/8;
+    unsigned char *visited = MAZE_CALLOC(visited_size, 1);
+    unsigned char *parent = MAZE_MALLOC(pm->row_bytes*pm->h);
+    int result = -1;
+
+    stats->memory = visited_size + pm->row_bytes*pm->h;
+    if (visited != NULL && parent != NULL && bfs_cells(pm, from, to, visited, parent, stats) == 0){
+        stats->length = bitmap_get(visited, to) ? parent_depth(pm, parent, to, from) : NO_PATH;
+        result = 0;
+    }
+    free(visited);
+    free(parent);
+    return result;
+}
+
+/**
+ * Breadth-first search from both ends, one whole level at a time from
+ * the end with the smaller frontier, until the two searches touch.
+ * Both share one parent grid: a cell is reached by one search only, and
+ * its parent leads back to the end that search started from.
+ */
+int solve_bidirectional(const struct packed_maze *pm, uint32_t from, uint32_t to, struct solve_stats *stats){
+    size_t seen_size = ((size_t)num_cells(pm)+7)/8;
+    unsigned char *seen[2] = {MAZE_CALLOC(seen_size, 1), MAZE_CALLOC(seen_size, 1)};
+    unsigned char *parent = MAZE_MALLOC(pm->row_bytes*pm->h);
+    uint32_t root[2] = {from, to};
+    struct cell_queue queue[2];
+    size_t peak = 0;
+    int result = -1;
+    int side, d;
+
+    init_cell_queue(&queue[0]);
+    init_cell_queue(&queue[1]);
+    stats->memory = 2*seen_size + pm->row_bytes*pm->h;
+    stats->length = from == to ? 0 : NO_PATH;
+    if (seen[0] == NULL || seen[1] == NULL || parent == NULL ||
+            queue_push(&queue[0], from) != 0 || queue_push(&queue[1], to) != 0)
+        goto done;
+    bitmap_set(seen[0], from);
+    bitmap_set(seen[1], to);
+
+    while (stats->length == NO_PATH && queue[0].size > 0 && queue[1].size > 0){
+        size_t level;
+        side = queue[1].size < queue[0].size;
+        for (level = queue[side].size; level > 0 && stats->length == NO_PATH; level--){
+            uint32_t i = queue_pop(&queue[side]);
+            unsigned int x = i%pm->w, y = i/pm->w;
+            stats->expanded++;
+            for (d = DIR_UP; d <= DIR_DOWN; d++){
+                uint32_t next;
+                if (!cell_open(pm, x, y, d)) continue;
+                next = cell_neighbour(pm, i, d);
+                if (bitmap_get(seen[!side], next)){ // the searches touch
+                    stats->length = parent_depth(pm, parent, i, root[side]) + 1 +
+                                    parent_depth(pm, parent, next, root[!side]);
+                    break;
+                }
+                if (bitmap_get(seen[side], next)) continue;
+                bitmap_set(seen[side], next);
+                grid2_set(parent, pm->row_bytes, next%pm->w, next/pm->w, opposite_direction(d));
+                if (queue_push(&queue[side], next) != 0) goto done;
+            }
+        }
+        if (queue[0].capacity + queue[1].capacity > peak) peak = queue[0].capacity + queue[1].capacity;
+    }
+    stats->memory += peak*sizeof(uint32_t);
+    result = 0;
+done:
+    free_cell_queue(&queue[0]);
+    free_cell_queue(&queue[1]);
+    free(seen[0]);
+    free(seen[1]);
+    free(parent);
+    return result;
+}
+
+/**
+ * Entry of the A* open list: the cost of the path so far and the
+ * estimated total cost of a path through the cell.
+ */
+struct astar_node{
+    uint32_t f;
+    uint32_t g;
+    uint32_t cell;
+};
+
+/**
+ * Returns whether node a comes out of the open list before node b: lower
+ * estimate first and, among equal estimates, the one further along.
+ */
+int astar_before(const struct astar_node *a, const struct astar_node *b){
+    return a->f < b->f || (a->f == b->f && a->g > b->g);
+}
+
+/**
+ * A* with the Manhattan distance, which never overestimates in a grid.
+ * A perfect maze is a tree, so every cell is reached once and needs no
+ * cost table: the cost travels in the open list.
+ */
+int solve_astar(const struct packed_maze *pm, uint32_t from, uint32_t to, struct solve_stats *stats){
+    size_t seen_size = ((size_t)num_cells(pm)+7)/8;
+    unsigned char *seen = MAZE_CALLOC(seen_size, 1);
+    struct astar_node *heap = NULL;
+    size_t size = 0, capacity = 0, peak = 0;
+    unsigned int tx = to%pm->w, ty = to/pm->w;
+    int d;
+
+    stats->length = NO_PATH;
+    if (seen == NULL) return -1;
+    bitmap_set(seen, from);
+    heap = MAZE_MALLOC(sizeof(*heap)*(capacity = 1024));
+    if (heap == NULL){
+        free(seen);
+        return -1;
+    }
+    heap[size++] = (struct astar_node){abs((int)(from%pm->w)-(int)tx) + abs((int)(from/pm->w)-(int)ty), 0, from};
+
+    while (size > 0){
+        struct astar_node node = heap[0];
+        unsigned int x = node.cell%pm->w, y = node.cell/pm->w;
+        size_t k = 0;
+
+        heap[0] = heap[--size]; // sift the last node down from the top
+        for (;;){
+            size_t c = 2*k+1;
+            struct astar_node tmp;
+            if (c >= size) break;
+            if (c+1 < size && astar_before(&heap[c+1], &heap[c])) c++;
+            if (!astar_before(&heap[c], &heap[k])) break;
+            tmp = heap[c];
+            heap[c] = heap[k];
+            heap[k] = tmp;
+            k = c;
+        }
+
+        stats->expanded++;
+        if (node.cell == to){
+            stats->length = node.g;
+            break;
+        }
+        for (d = DIR_UP; d <= DIR_DOWN; d++){
+            uint32_t next;
+            unsigned int nx, ny;
+            if (!cell_open(pm, x, y, d)) continue;
+            next = cell_neighbour(pm, node.cell, d);
+            if (bitmap_get(seen, next)) continue;
+            bitmap_set(seen, next);
+            if (size == capacity){
+                struct astar_node *bigger = MAZE_REALLOC(heap, sizeof(*heap)*capacity*2);
+                if (bigger == NULL){
+                    free(heap);
+                    free(seen);
+                    return -1;
+                }
+                heap = bigger;
+                capacity *= 2;
+            }
+            nx = next%pm->w;
+            ny = next/pm->w;
+            k = size++; // sift the new node up
+            heap[k] = (struct astar_node){node.g + 1 + abs((int)nx-(int)tx) + abs((int)ny-(int)ty), node.g + 1, next};
+            while (k > 0 && astar_before(&heap[k], &heap[(k-1)/2])){
+                struct astar_node tmp = heap[k];
+                heap[k] = heap[(k-1)/2];
+                heap[(k-1)/2] = tmp;
+                k = (k-1)/2;
+            }
+        }
+        if (capacity > peak) peak = capacity;
+    }
+    stats->memory = seen_size + peak*sizeof(*heap);
+    free(heap);
+    free(seen);
+    return 0;
+}
+
+/**
+ * Returns the number of open neighbours of cell i that are not filled.
+ * *last gets one of them.
+ */
+int unfilled_degree(const struct packed_maze *pm, const unsigned char *filled, uint32_t i, uint32_t *last){
+    unsigned int x = i%pm->w, y = i/pm->w;
+    int n = 0, d;
+    for (d = DIR_UP; d <= DIR_DOWN; d++){
+        uint32_t next;
+        if (!cell_open(pm, x, y, d)) continue;
+        next = cell_neighbour(pm, i, d);
+        if (bitmap_get(filled, next)) continue;
+        *last = next;
+        n++;
+    }
+    return n;
+}
+
+/**
+ * Dead-end filling: every dead end but the two ends is filled along its
+ * corridor up to the next junction. In a perfect maze the cells left are
+ * exactly the path. Each cell is filled once, one bit each, and nothing
+ * is queued.
+ */
+int solve_dead_end_fill(const struct packed_maze *pm, uint32_t from, uint32_t to, struct solve_stats *stats){
+    uint32_t n = num_cells(pm);
+    size_t filled_size = ((size_t)n+7)/8;
+    unsigned char *filled = MAZE_CALLOC(filled_size, 1);
+    uint32_t i;
+
+    if (filled == NULL) return -1;
+    stats->memory = filled_size;
+    for (i = 0; i < n; i++){
+        uint32_t cell = i;
+        for (;;){ // fill the corridor starting at a dead end
+            uint32_t next = cell;
+            if (cell == from || cell == to || bitmap_get(filled, cell) ||
+                    unfilled_degree(pm, filled, cell, &next) > 1)
+                break;
+            bitmap_set(filled, cell);
+            stats->expanded++;
+            if (next == cell) break; // a cell with no way out
+            cell = next;
+        }
+    }
+    stats->length = n - stats->expanded - 1;
+    free(filled);
+    return 0;
+}
+
+/**
+ * Gathers bits 0, 2, 4 and 6 of b into bits 0 to 3.
+ */
+unsigned int even_bits(unsigned int b){
+    b &= 0x55;
+    b = (b | b >> 1) & 0x33;
+    return (b | b >> 2) & 0x0f;
+}
+
+/**
+ * Breadth-first search a word at a time: the frontier is a bitmap and one
+ * 64 bit word steps up to 64 cells at once with shifts and masks of the
+ * open walls. Only the words holding part of the frontier are visited,
+ * so sparse frontiers cost no full passes over the maze.
+ */
+int solve_bit_parallel(const struct packed_maze *pm, uint32_t from, uint32_t to, struct solve_stats *stats){
+    size_t wpr = ((size_t)pm->w+63)/64; // words per row of cells
+    size_t words = wpr*pm->h;
+    uint64_t *east = MAZE_CALLOC(words, sizeof(uint64_t));  // bit set if open to the east
+    uint64_t *south = MAZE_CALLOC(words, sizeof(uint64_t)); // bit set if open to the south
+    uint64_t *seen = MAZE_CALLOC(words, sizeof(uint64_t));
+    uint64_t *frontier = MAZE_CALLOC(words, sizeof(uint64_t));
+    uint64_t *next = MAZE_CALLOC(words, sizeof(uint64_t));
+    size_t *active = MAZE_MALLOC(words*sizeof(size_t));      // words of frontier with bits set
+    size_t *next_active = MAZE_MALLOC(words*sizeof(size_t));
+    size_t num_active = 1, num_next, a, to_word = to/pm->w*wpr + to%pm->w/64;
+    uint64_t to_bit = (uint64_t)1 << (to%pm->w%64);
+    uint64_t level = 0;
+    unsigned int y;
+    size_t j;
+    int result = -1;
+
+    stats->memory = 5*words*sizeof(uint64_t) + 2*words*sizeof(size_t);
+    stats->length = NO_PATH;
+    if (!east || !south || !seen || !frontier || !next || !active || !next_active) goto done;
+
+    for (y = 0; y < pm->h; y++){ // the open walls, one bit per cell, four cells per byte of walls
+        for (j = 0; j < ((size_t)pm->w+3)/4; j++){
+            unsigned int open = ~pm->walls[y*pm->row_bytes+j] & 0xff;
+            east[y*wpr+j/16] |= (uint64_t)even_bits(open) << (j%16*4);
+            if (y+1 < pm->h) south[y*wpr+j/16] |= (uint64_t)even_bits(open >> 1) << (j%16*4);
+        }
+        east[y*wpr+(pm->w-1)/64] &= ~((uint64_t)1 << ((pm->w-1)%64)); // the border
+    }
+
+    active[0] = from/pm->w*wpr + from%pm->w/64;
+    frontier[active[0]] = seen[active[0]] = (uint64_t)1 << (from%pm->w%64);
+    while (num_active > 0 && !(seen[to_word] & to_bit)){
+        num_next = 0;
+        for (a = 0; a < num_active; a++){
+            size_t i = active[a], k = i%wpr;
+            uint64_t f = frontier[i];
+            uint64_t add[4];
+            size_t target[4];
+            int t, n = 0;
+
+            frontier[i] = 0;
+            stats->expanded += __builtin_popcountll(f);
+            // east and west within the word, then across to the words beside
+            target[n] = i; add[n++] = ((f & east[i]) << 1) | ((f >> 1) & east[i]);
+            if (k+1 < wpr){ target[n] = i+1; add[n++] = (f & east[i]) >> 63; }
+            if (k > 0){ target[n] = i-1; add[n++] = (f << 63) & east[i-1]; }
+            if (i+wpr < words){ target[n] = i+wpr; add[n++] = f & south[i]; }
+            for (t = 0; t < n; t++){
+                uint64_t bits = add[t] & ~seen[target[t]];
+                if (bits == 0) continue;
+                if (next[target[t]] == 0) next_active[num_next++] = target[t];
+                next[target[t]] |= bits;
+                seen[target[t]] |= bits;
+            }
+            if (i >= wpr){ // north
+                uint64_t bits = f & south[i-wpr] & ~seen[i-wpr];
+                if (bits != 0){
+                    if (next[i-wpr] == 0) next_active[num_next++] = i-wpr;
+                    next[i-wpr] |= bits;
+                    seen[i-wpr] |= bits;
+                }
+            }
+        }
+        { // the next frontier becomes the current one
+            uint64_t *tmp = frontier;
+            size_t *tmp_active = active;
+            frontier = next;
+            next = tmp;
+            active = next_active;
+            next_active = tmp_active;
+            num_active = num_next;
+        }
+        level++;
+    }
+    if (seen[to_word] & to_bit) stats->length = level;
+    result = 0;
+done:
+    free(east);
+    free(south);
+    free(seen);
+    free(frontier);
+    free(next);
+    free(active);
+    free(next_active);
+    return result;
+}
+
+/**
+ * A way to find the shortest path between two cells.
+ * solve returns 0 on success, -1 if out of memory.
+ */
+struct solver{
+    const char *name;
+    int (*solve)(const struct packed_maze *pm, uint32_t from, uint32_t to, struct solve_stats *stats);
+};
+
+const struct solver solvers[] = {
+    {"bfs", solve_bfs},
+    {"bidirectional", solve_bidirectional},
+    {"astar", solve_astar},
+    {"dead-end-fill", solve_dead_end_fill},
+    {"bit-parallel", solve_bit_parallel},
+};
+
+#define NUM_SOLVERS (sizeof(solvers)/sizeof(solvers[0]))
+
+/**
+ * A position in the char matrix of a maze.
+ */
+struct position{
+    long row;
+    long col;
+};
+
+long manhattan(struct position a, struct position b){
+    return labs(a.row-b.row) + labs(a.col-b.col);
+}
+
+/**
+ * Returns the index of the cell whose square, or the walls around it,
+ * holds matrix position pos. A position in the wall between two cells
+ * belongs to either; the one on the left or above is returned.
+ */
+uint32_t position_cell(const struct packed_maze *pm, struct position pos){
+    long p = pm->cell_size+1;
+    long x = pos.col > 0 ? (pos.col-1)/p : 0;
+    long y = pos.row > 0 ? (pos.row-1)/p : 0;
+    if (x >= pm->w) x = pm->w-1;
+    if (y >= pm->h) y = pm->h-1;
+    return (uint32_t)y*pm->w + x;
+}
+
+/**
+ * Returns the k-th of the cell_size matrix positions of the opening from
+ * cell i towards its neighbour in direction d.
+ */
+struct position gate_position(const struct packed_maze *pm, uint32_t i, enum direction d, unsigned int k){
+    long p = pm->cell_size+1;
+    long x0 = 1 + (long)(i%pm->w)*p; // top left char of the square of the cell
+    long y0 = 1 + (long)(i/pm->w)*p;
+    switch (d){
+        case DIR_UP: return (struct position){y0-1, x0+k};
+        case DIR_LEFT: return (struct position){y0+k, x0-1};
+        case DIR_RIGHT: return (struct position){y0+k, x0+pm->cell_size};
+        default: return (struct position){y0+pm->cell_size, x0+k};
+    }
+}
+
+/**
+ * Returns the fewest matrix steps from a to b, path holding the n cells
+ * from the cell of a to the cell of b. Any two positions of the square of
+ * a cell and of its openings are their Manhattan distance apart, so a
+ * walk only has to choose which char of each opening on the way to
+ * cross; the choice is made by dynamic programming over the openings.
+ * If crossing is not NULL it gets the chosen char of each of the n-1
+ * openings.
+ * Returns NO_PATH if out of memory.
+ */
+uint64_t path_steps(const struct packed_maze *pm, struct position a, struct position b, const uint32_t *path, size_t n, unsigned int *crossing){
+    unsigned int cs = pm->cell_size;
+    uint64_t *costs = MAZE_MALLOC(2*cs*sizeof(*costs));
+    uint64_t *cost = costs, *next_cost = costs + cs, *tmp, best = NO_PATH;
+    unsigned int *from = crossing ? MAZE_MALLOC((n-1)*cs*sizeof(*from)) : NULL; // best previous char, by opening and char
+    enum direction prev, d;
+    unsigned int s, t, last = 0;
+    size_t i;
+
+    if (n == 1){
+        free(costs);
+        free(from);
+        return manhattan(a, b);
+    }
+    if (costs == NULL || (crossing != NULL && from == NULL)){
+        free(costs);
+        free(from);
+        return NO_PATH;
+    }
+    d = index_direction(path[0], path[1]);
+    for (t = 0; t < cs; t++) cost[t] = manhattan(a, gate_position(pm, path[0], d, t));
+    for (i = 1; i+1 < n; i++){ // from the opening into path[i] to the one out of it
+        prev = d;
+        d = index_direction(path[i], path[i+1]);
+        for (t = 0; t < cs; t++){
+            struct position out = gate_position(pm, path[i], d, t);
+            next_cost[t] = NO_PATH;
+            for (s = 0; s < cs; s++){
+                uint64_t c = cost[s] + manhattan(gate_position(pm, path[i-1], prev, s), out);
+                if (c >= next_cost[t]) continue;
+                next_cost[t] = c;
+                if (from != NULL) from[i*cs+t] = s;
+            }
+        }
+        tmp = cost;
+        cost = next_cost;
+        next_cost = tmp;
+    }
+    for (s = 0; s < cs; s++){
+        uint64_t c = cost[s] + manhattan(gate_position(pm, path[n-2], d, s), b);
+        if (c >= best) continue;
+        best = c;
+        last = s;
+    }
+    if (crossing != NULL){
+        crossing[n-2] = last;
+        for (i = n-2; i > 0; i--) crossing[i-1] = from[i*cs+crossing[i]];
+    }
+    free(costs);
+    free(from);
+    return best;
+}
+
+/**
+ * Movement keys of a walk through a maze, growing as needed.
+ */
+struct moves{
+    char *keys;
+    size_t n;
+    size_t capacity;
+};
+
+void init_moves(struct moves *m){
+    m->keys = NULL;
+    m->n = 0;
+    m->capacity = 0;
+}
+
+void free_moves(struct moves *m){
+    free(m->keys);
+    init_moves(m);
+}
+
+/**
+ * Appends count times key.
+ * Returns 0 on success, -1 if out of memory.
+ */
+int add_moves(struct moves *m, char key, long count){
+    if (m->n + count > m->capacity){
+        size_t capacity = m->capacity ? m->capacity : 1024;
+        char *keys;
+        while (capacity < m->n + count) capacity *= 2;
+        if ((keys = MAZE_REALLOC(m->keys, capacity)) == NULL) return -1;
+        m->keys = keys;
+        m->capacity = capacity;
+    }
+    memset(m->keys + m->n, key, count);
+    m->n += count;
+    return 0;
+}
+
+/**
+ * Returns the key moving the player in direction d.
+ */
+char direction_key(enum direction d){
+    static const char keys[] = {MOVE_UP, MOVE_LEFT, MOVE_RIGHT, MOVE_DOWN};
+    return keys[d];
+}
+
+/**
+ * Appends the keys of the straight walk from a to b, which share a row
+ * or a column.
+ * Returns 0 on success, -1 if out of memory.
+ */
+int walk_straight(struct moves *m, struct position a, struct position b){
+    if (b.col > a.col) return add_moves(m, MOVE_RIGHT, b.col-a.col);
+    if (b.col < a.col) return add_moves(m, MOVE_LEFT, a.col-b.col);
+    if (b.row > a.row) return add_moves(m, MOVE_DOWN, b.row-a.row);
+    return add_moves(m, MOVE_UP, a.row-b.row);
+}
+
+/**
+ * Returns pos moved one step into the square of cell i if it is in the
+ * walls around the square.
+ */
+struct position step_inside(const struct packed_maze *pm, uint32_t i, struct position pos){
+    long p = pm->cell_size+1;
+    long x0 = 1 + (long)(i%pm->w)*p;
+    long y0 = 1 + (long)(i/pm->w)*p;
+    if (pos.col < x0) pos.col++;
+    else if (pos.col >= x0+pm->cell_size) pos.col--;
+    else if (pos.row < y0) pos.row++;
+    else if (pos.row >= y0+pm->cell_size) pos.row--;
+    return pos;
+}
+
+/**
+ * Appends the keys walking from a to b, two positions of the square of
+ * cell i or of its openings, in their Manhattan distance: into the
+ * square, along a row and a column of it, and out.
+ * Returns 0 on success, -1 if out of memory.
+ */
+int walk_in_cell(const struct packed_maze *pm, uint32_t i, struct position a, struct position b, struct moves *m){
+    struct position a_in, b_in, corner;
+    if (a.row == b.row || a.col == b.col) return walk_straight(m, a, b);
+    a_in = step_inside(pm, i, a);
+    b_in = step_inside(pm, i, b);
+    corner = (struct position){a_in.row, b_in.col};
+    if (walk_straight(m, a, a_in) != 0 || walk_straight(m, a_in, corner) != 0 ||
+            walk_straight(m, corner, b_in) != 0 || walk_straight(m, b_in, b) != 0)
+        return -1;
+    return 0;
+}
+
+/**
+ * Stores in (*path)[0..*n) the cells from root to target, following
+ * parent from a search started at root. *path grows as needed,
+ * *capacity being its size.
+ * Returns 0 on success, -1 if out of memory.
+ */
+int cell_path(const struct packed_maze *pm, const unsigned char *parent, uint32_t root, uint32_t target, uint32_t **path, size_t *capacity, size_t *n){
+    size_t k;
+    *n = parent_depth(pm, parent, target, root) + 1;
+    if (*n > *capacity){
+        uint32_t *bigger = MAZE_REALLOC(*path, *n*sizeof(**path));
+        if (bigger == NULL) return -1;
+        *path = bigger;
+        *capacity = *n;
+    }
+    for (k = *n; k > 0; k--){
+        (*path)[k-1] = target;
+        if (k > 1) target = cell_neighbour(pm, target, grid2_get(parent, pm->row_bytes, target%pm->w, target/pm->w));
+    }
+    return 0;
+}
+
+/**
+ * Distances from every position of a maze to one target position, worked
+ * out once so that a query costs O(cell_size) however big the maze is.
+ * toward, laid out like the walls, has for every cell the direction of
+ * the next cell on the way to the target. steps has cell_size distances
+ * per cell, the matrix steps to the target from each char of the opening
+ * towards that next cell: 16 bits each when the matrix is small enough
+ * for them, 32 otherwise.
+ */
+struct distance_field{
+    struct position target;
+    uint32_t root; // cell of the target
+    unsigned char *toward;
+    void *steps;
+    int wide; // steps are uint32_t rather than uint16_t
+};
+
+/**
+ * Returns whether the distances of a field of pm need 32 bits.
+ */
+int field_is_wide(const struct packed_maze *pm){
+    return (uint64_t)packed_matrix_width(pm)*packed_matrix_height(pm) >= UINT16_MAX;
+}
+
+/**
+ * Bytes a distance field of pm takes.
+ */
+size_t distance_field_size(const struct packed_maze *pm){
+    return (size_t)num_cells(pm)*pm->cell_size*(field_is_wide(pm) ? 4 : 2) + pm->row_bytes*pm->h;
+}
+
+/**
+ * Returns the k-th distance of f, NO_PATH if the target cannot be reached.
+ */
+uint64_t field_steps(const struct distance_field *f, size_t k){
+    if (f->wide) return ((uint32_t*)f->steps)[k] == UINT32_MAX ? NO_PATH : ((uint32_t*)f->steps)[k];
+    return ((uint16_t*)f->steps)[k] == UINT16_MAX ? NO_PATH : ((uint16_t*)f->steps)[k];
+}
+
+void set_field_steps(struct distance_field *f, size_t k, uint64_t steps){
+    if (f->wide) ((uint32_t*)f->steps)[k] = steps;
+    else ((uint16_t*)f->steps)[k] = steps;
+}
+
+/**
+ * Computes into f the distances of pm to target, with a breadth-first
+ * search of the cells from the cell of target: the distances of a cell
+ * follow from those of the cell it was reached from.
+ * Returns 0 on success, -1 if out of memory.
+ */
+int init_distance_field(struct distance_field *f, const struct packed_maze *pm, struct position target){
+    unsigned int cs = pm->cell_size;
+    size_t steps_size = (size_t)num_cells(pm)*cs*(field_is_wide(pm) ? 4 : 2);
+    unsigned char *visited = MAZE_CALLOC(((size_t)num_cells(pm)+7)/8, 1);
+    struct cell_queue queue;
+    int d, result = -1;
+
+    f->target = target;
+    f->root = position_cell(pm, target);
+    f->wide = field_is_wide(pm);
+    f->toward = MAZE_CALLOC(pm->row_bytes, pm->h);
+    f->steps = MAZE_MALLOC(steps_size);
+    init_cell_queue(&queue);
+    if (visited == NULL || f->toward == NULL || f->steps == NULL) goto done;
+    memset(f->steps, 0xff, steps_size); // unreachable until reached
+    bitmap_set(visited, f->root);
+    if (queue_push(&queue, f->root) != 0) goto done;
+    while (queue.size > 0){
+        uint32_t i = queue_pop(&queue);
+        unsigned int x = i%pm->w, y = i/pm->w;
+        enum direction on = grid2_get(f->toward, pm->row_bytes, x, y);
+        for (d = DIR_UP; d <= DIR_DOWN; d++){
+            uint32_t next;
+            unsigned int s, t;
+            if (!cell_open(pm, x, y, d)) continue;
+            next = cell_neighbour(pm, i, d);
+            if (bitmap_get(visited, next)) continue;
+            bitmap_set(visited, next);
+            grid2_set(f->toward, pm->row_bytes, next%pm->w, next/pm->w, opposite_direction(d));
+            for (s = 0; s < cs; s++){ // from the opening between next and i, across i
+                struct position gate = gate_position(pm, i, d, s);
+                uint64_t best = i == f->root ? (uint64_t)manhattan(gate, target) : NO_PATH;
+                for (t = 0; i != f->root && t < cs; t++){
+                    uint64_t c = manhattan(gate, gate_position(pm, i, on, t)) + field_steps(f, (size_t)i*cs+t);
+                    if (c < best) best = c;
+                }
+                set_field_steps(f, (size_t)next*cs+s, best);
+            }
+            if (queue_push(&queue, next) != 0) goto done;
+        }
+    }
+    result = 0;
+done:
+    free_cell_queue(&queue);
+    free(visited);
+    if (result != 0){
+        free(f->toward);
+        free(f->steps);
+        f->toward = NULL;
+        f->steps = NULL;
+    }
+    return result;
+}
+
+void free_distance_field(struct distance_field *f){
+    free(f->toward);
+    free(f->steps);
+    f->toward = NULL;
+    f->steps = NULL;
+}
+
+/**
+ * Returns the direction of the straight line from a to b.
+ */
+enum direction straight_direction(struct position a, struct position b){
+    if (b.col > a.col) return DIR_RIGHT;
+    if (b.col < a.col) return DIR_LEFT;
+    return b.row > a.row ? DIR_DOWN : DIR_UP;
+}
+
+/**
+ * Returns the direction of the first step of the walk of walk_in_cell
+ * from a to b, two different positions of cell i.
+ */
+enum direction first_step(const struct packed_maze *pm, uint32_t i, struct position a, struct position b){
+    struct position a_in, b_in;
+    if (a.row == b.row || a.col == b.col) return straight_direction(a, b);
+    a_in = step_inside(pm, i, a);
+    if (a_in.row != a.row || a_in.col != a.col) return straight_direction(a, a_in);
+    b_in = step_inside(pm, i, b);
+    if (b_in.col != a.col) return straight_direction(a, (struct position){a.row, b_in.col});
+    return straight_direction(a, b_in);
+}
+
+/**
+ * Returns the matrix steps from pos to the target of f, or NO_PATH if
+ * there is no way, and stores in *next the direction of the first step
+ * (left alone when pos is the target).
+ */
+uint64_t field_distance(const struct distance_field *f, const struct packed_maze *pm, struct position pos, enum direction *next){
+    long p = pm->cell_size+1;
+    uint32_t cells[2];
+    unsigned int n = 0, k, s;
+    uint64_t best = NO_PATH;
+
+    cells[n++] = position_cell(pm, pos);
+    // a position in an opening belongs to the cells on both sides of it
+    if (pos.col > 0 && (pos.col-1)%p == p-1 && (pos.col-1)/p+1 < pm->w) cells[n++] = cells[0]+1;
+    else if (pos.row > 0 && (pos.row-1)%p == p-1 && (pos.row-1)/p+1 < pm->h) cells[n++] = cells[0]+pm->w;
+    for (k = 0; k < n; k++){
+        uint32_t i = cells[k];
+        struct position goal = f->target;
+        uint64_t steps = NO_PATH;
+        if (i == f->root){
+            steps = manhattan(pos, goal);
+        }else{
+            enum direction d = grid2_get(f->toward, pm->row_bytes, i%pm->w, i/pm->w);
+            for (s = 0; s < pm->cell_size; s++){
+                struct position gate = gate_position(pm, i, d, s);
+                uint64_t c = field_steps(f, (size_t)i*pm->cell_size+s);
+                // standing in that opening, the cell beyond it knows the way on
+                if (c == NO_PATH || (gate.row == pos.row && gate.col == pos.col)) continue;
+                c += manhattan(pos, gate);
+                if (c >= steps) continue;
+                steps = c;
+                goal = gate;
+            }
+        }
+        if (steps >= best) continue;
+        best = steps;
+        if (steps > 0) *next = first_step(pm, i, pos, goal);
+    }
+    return best;
+}
+
+/**
+ * The shortest way to win a maze: from the entry, through
+ * NEEDED_POTIONS potions, to the exit. A maze with more than
+ * SOLVE_MAX_POTIONS potions is only routed through the SOLVE_MAX_POTIONS
+ * nearest the way from the entry to the exit, so solving costs the same
+ * however many potions there are.
+ */
+#define SOLVE_MAX_POTIONS 16
+
+struct route{
+    uint64_t steps; // NO_PATH if the game cannot be won
+    unsigned int potions[NEEDED_POTIONS]; // items picked up, in order
+};
+
+struct route_candidate{
+    uint64_t steps; // from the entry through the potion to the exit
+    unsigned int item;
+};
+
+int compare_candidates(const void *a, const void *b){
+    const struct route_candidate *x = (const struct route_candidate*)a, *y = (const struct route_candidate*)b;
+    if (x->steps != y->steps) return x->steps < y->steps ? -1 : 1;
+    return (x->item > y->item) - (x->item < y->item);
+}
+
+/**
+ * Stores in pick the items of pm a route goes through: all of them, or
+ * with more than SOLVE_MAX_POTIONS the SOLVE_MAX_POTIONS with the fewest
+ * steps from entry through them to exit, found with a distance field
+ * from each end.
+ * Returns how many, or -1 if out of memory.
+ */
+long pick_route_potions(const struct packed_maze *pm, struct position entry, struct position exit, unsigned int *pick){
+    struct distance_field from, to;
+    struct route_candidate *c;
+    enum direction next;
+    unsigned int i, n = pm->num_items;
+
+    if (n <= SOLVE_MAX_POTIONS){
+        for (i = 0; i < n; i++) pick[i] = i;
+        return n;
+    }
+    to.toward = NULL;
+    to.steps = NULL;
+    if ((c = (struct route_candidate*)MAZE_MALLOC(n*sizeof(*c))) == NULL || init_distance_field(&from, pm, entry) != 0){
+        free(c);
+        return -1;
+    }
+    if (init_distance_field(&to, pm, exit) != 0){
+        free(c);
+        free_distance_field(&from);
+        return -1;
+    }
+    for (i = 0; i < n; i++){
+        struct position pos = {pm->items[i].row, pm->items[i].col};
+        uint64_t a = field_distance(&from, pm, pos, &next), b = field_distance(&to, pm, pos, &next);
+        c[i].steps = a == NO_PATH || b == NO_PATH ? NO_PATH : a+b;
+        c[i].item = i;
+    }
+    qsort(c, n, sizeof(*c), compare_candidates);
+    for (i = 0; i < SOLVE_MAX_POTIONS; i++) pick[i] = c[i].item;
+    free(c);
+    free_distance_field(&from);
+    free_distance_field(&to);
+    return SOLVE_MAX_POTIONS;
+}
+
+/**
+ * Tries every way to go on from the first depth points of order, where
+ * point 0 is the entry, points 1 to n-2 the potions and n-1 the exit,
+ * keeping the shortest complete route in route. steps is the length so
+ * far.
+ */
+void search_route(const uint64_t *dist, unsigned int n, unsigned int *order, unsigned int depth, uint64_t steps, struct route *route){
+    unsigned int p, k;
+    if (steps >= route->steps) return;
+    if (depth == NEEDED_POTIONS+1){
+        steps += dist[order[depth-1]*n + n-1];
+        if (steps >= route->steps) return;
+        route->steps = steps;
+        for (k = 0; k < NEEDED_POTIONS; k++) route->potions[k] = order[k+1]-1;
+        return;
+    }
+    for (p = 1; p+1 < n; p++){
+        for (k = 1; k < depth && order[k] != p; k++);
+        if (k < depth || dist[order[depth-1]*n + p] == NO_PATH) continue;
+        order[depth] = p;
+        search_route(dist, n, order, depth+1, steps + dist[order[depth-1]*n + p], route);
+    }
+}
+
+/**
+ * Finds the shortest route winning pm into *route through the potions
+ * of pick_route_potions: the distances between the entry, those potions
+ * and the exit are found walking the tree of cells, then every order of
+ * the potions is tried. If moves is not NULL it gets the keys walking
+ * the route.
+ * Returns 0 on success, -1 if out of memory.
+ */
+int solve_route(const struct packed_maze *pm, struct route *route, struct moves *moves){
+    struct position entry = {1, 0};
+    struct position exit = {packed_matrix_height(pm)-2, packed_matrix_width(pm)-1};
+    unsigned int pick[SOLVE_MAX_POTIONS];
+    long picked = pick_route_potions(pm, entry, exit, pick);
+    unsigned int n = picked < 0 ? 0 : picked + 2;
+    struct position *points = MAZE_MALLOC(n*sizeof(*points));
+    uint64_t *dist = MAZE_MALLOC((size_t)n*n*sizeof(*dist));
+    unsigned int *order = MAZE_MALLOC(n*sizeof(*order));
+    size_t visited_size = ((size_t)num_cells(pm)+7)/8;
+    unsigned char *visited = MAZE_MALLOC(visited_size);
+    unsigned char *parent = MAZE_MALLOC(pm->row_bytes*pm->h);
+    uint32_t *path = NULL;
+    unsigned int *crossing = NULL;
+    size_t path_capacity = 0, path_n = 0;
+    struct solve_stats stats = {0, 0, 0};
+    unsigned int i, j, leg;
+    int result = -1;
+
+    route->steps = NO_PATH;
+    if (picked < 0 || !points || !dist || !order || !visited || !parent) goto done;
+    points[0] = entry;
+    for (i = 0; i < picked; i++) points[i+1] = (struct position){pm->items[pick[i]].row, pm->items[pick[i]].col};
+    points[n-1] = exit;
+
+    for (i = 0; i+1 < n; i++){ // every distance, one search per point
+        uint32_t root = position_cell(pm, points[i]);
+        memset(visited, 0, visited_size);
+        if (bfs_cells(pm, root, UINT32_MAX, visited, parent, &stats) != 0) goto done;
+        dist[i*n+i] = 0;
+        for (j = i+1; j < n; j++){
+            uint32_t target = position_cell(pm, points[j]);
+            if (!bitmap_get(visited, target)){
+                dist[i*n+j] = dist[j*n+i] = NO_PATH;
+                continue;
+            }
+            if (cell_path(pm, parent, root, target, &path, &path_capacity, &path_n) != 0) goto done;
+            dist[i*n+j] = dist[j*n+i] = path_steps(pm, points[i], points[j], path, path_n, NULL);
+            if (dist[i*n+j] == 0){ // potions are picked up stepping on them, so step off and back
+                if (j < n-1) dist[i*n+j] = 2;
+                if (i > 0) dist[j*n+i] = 2;
+            }
+        }
+    }
+    order[0] = 0;
+    if (n-2 >= NEEDED_POTIONS) search_route(dist, n, order, 1, 0, route);
+
+    for (leg = 0; moves != NULL && route->steps != NO_PATH && leg <= NEEDED_POTIONS; leg++){
+        struct position start = points[leg == 0 ? 0 : route->potions[leg-1]+1];
+        struct position b = points[leg == NEEDED_POTIONS ? n-1 : route->potions[leg]+1];
+        struct position a = start;
+        uint32_t root = position_cell(pm, a);
+        size_t k;
+
+        memset(visited, 0, visited_size);
+        if (bfs_cells(pm, root, position_cell(pm, b), visited, parent, &stats) != 0 ||
+                cell_path(pm, parent, root, position_cell(pm, b), &path, &path_capacity, &path_n) != 0)
+            goto done;
+        free(crossing);
+        if ((crossing = MAZE_MALLOC(path_n*sizeof(*crossing))) == NULL ||
+                path_steps(pm, a, b, path, path_n, crossing) == NO_PATH)
+            goto done;
+        for (k = 0; k+1 < path_n; k++){ // to the chosen char of each opening in turn
+            struct position gate = gate_position(pm, path[k], index_direction(path[k], path[k+1]), crossing[k]);
+            if (walk_in_cell(pm, path[k], a, gate, moves) != 0) goto done;
+            a = gate;
+        }
+        if (walk_in_cell(pm, path[path_n-1], a, b, moves) != 0) goto done;
+        if (manhattan(start, b) == 0 && leg < NEEDED_POTIONS){
+            enum direction d = DIR_UP; // the potion is where the player stands
+            while (packed_is_wall(pm, a.row + (d == DIR_DOWN) - (d == DIR_UP), a.col + (d == DIR_RIGHT) - (d == DIR_LEFT))) d++;
+            if (add_moves(moves, direction_key(d), 1) != 0 || add_moves(moves, direction_key(opposite_direction(d)), 1) != 0)
+                goto done;
+        }
+    }
+    for (i = 0; route->steps != NO_PATH && i < NEEDED_POTIONS; i++) route->potions[i] = pick[route->potions[i]];
+    result = 0;
+done:
+    free(points);
+    free(dist);
+    free(order);
+    free(visited);
+    free(parent);
+    free(path);
+    free(crossing);
+    return result;
+}
+
+//-----------------------------------------------------------------------------
+
+/**
+ * An endless maze made of chunks of CHUNK_CELLS x CHUNK_CELLS cells,
+ * generated when they are first needed. Chunk (cx, cy) is the packed
+ * maze of derive_seed(seed, chunk_id), and the opening in each of its
+ * east and south borders is drawn from the seed as well, so any chunk
+ * can be generated alone and a seed always gives the same world.
+ * Positions are those of the char matrix of a packed maze of
+ * WORLD_CHUNKS x WORLD_CHUNKS chunks; the player starts in the middle,
+ * over a billion cells from the border.
+ * At most capacity chunks are kept and the least recently used one makes
+ * room for a new one, so memory does not grow with the distance walked.
+ * A thread generates the chunks a frame may show and those ahead of the
+ * player (see world_look_ahead). A chunk needed before it is ready is
+ * left unexplored, drawn blank and closed to the player until the thread
+ * has it, so a move never waits for a chunk. Only scripted games (see
+ * wait) and a world whose thread could not start generate it on the
+ * spot. The potions collected are remembered, so they stay gone when
+ * their chunk is generated again.
+ */
+#define CHUNK_CELLS 64
+#define CHUNK_POTIONS 1
+#define WORLD_CHUNKS ((uint32_t)1 << 24)
+#define WORLD_CACHE_CHUNKS 64
+#define PREFETCH_SLOTS 32
+#define PREFETCH_AHEAD 2 // rows of chunks generated beyond those a frame may show
+#define PREFETCH_POLL_MS 10 // how often play looks for the chunks it waits for
+
+struct chunk{
+    uint64_t id;   // see chunk_id
+    uint64_t used; // tick of the last lookup, 0 for a free slot
+    int next;      // next chunk in the same bucket, -1 for none
+    struct packed_maze maze;
+};
+
+/**
+ * A chunk handed to the prefetch thread. WANTED slots are picked up by
+ * the thread, BUSY ones are its own until they are READY, and READY ones
+ * are moved into the cache by world_collect.
+ */
+enum prefetch_state{
+    PREFETCH_FREE,
+    PREFETCH_WANTED,
+    PREFETCH_BUSY,
+    PREFETCH_READY
+};
+
+struct prefetch_slot{
+    uint64_t id;
+    enum prefetch_state state;
+    struct packed_maze maze;
+};
+
+struct world{
+    int seed;
+    unsigned int cell_size;
+    struct chunk *chunks;
+    unsigned int capacity;
+    int *buckets;             // first chunk of each hash bucket, -1 for none
+    unsigned int num_buckets; // a power of two
+    uint64_t tick;
+    struct chunk *last;       // chunk of the last lookup, most lookups are in it
+    struct position *taken;   // hash set of the potions collected, row 0 for an empty slot
+    size_t taken_capacity;
+    size_t num_taken;
+    long ahead_row, ahead_col; // player position and direction of the last look ahead
+    long ahead_dx, ahead_dy;
+    long ahead_x0, ahead_y0, ahead_x1, ahead_y1; // chunks a frame may show then, x0 < 0 to ask again
+    long reach_rows, reach_cols; // how far from the player a frame shows, see world_set_view
+    int wait;                 // generate the chunks not ready on the spot, for scripted games
+    int missing;              // a lookup found a chunk not ready
+    unsigned long arrived;    // chunks moved into the cache by world_collect
+    struct prefetch_slot prefetch[PREFETCH_SLOTS];
+    pthread_mutex_t lock;     // guards prefetch and stop
+    pthread_cond_t wake;
+    pthread_t thread;
+    int has_thread;
+    int stop;
+    unsigned long generated;  // chunks generated while the player waited
+    unsigned long prefetched; // chunks the thread had ready
+};
+
+uint64_t chunk_id(uint64_t cx, uint64_t cy){
+    return cx << 32 | cy;
+}
+
+/**
+ * Returns the width and height of the char matrix of world.
+ */
+long world_matrix_size(const struct world *world){
+    return 1 + (long)WORLD_CHUNKS*CHUNK_CELLS*(world->cell_size+1);
+}
+
+/**
+ * Returns the cell of the opening in the east border of chunk id (its
+ * row of cells) or, if south, in its south border (its column).
+ */
+unsigned int border_opening(const struct world *world, uint64_t id, int south){
+    return derive_seed(world->seed, id, 1 + south) % CHUNK_CELLS;
+}
+
+/**
+ * Generates chunk id of the world of seed into pm.
+ * Returns 0 on success, -1 if out of memory.
+ */
+int generate_chunk(int seed, unsigned int cell_size, uint64_t id, struct packed_maze *pm){
+    struct maze_gen gen;
+    int result;
+    PROFILE_START(start);
+    init_maze_gen(&gen, CHUNK_CELLS, CHUNK_CELLS, cell_size, derive_seed(seed, id, 0));
+    gen.num_potions = CHUNK_POTIONS;
+    result = gen_packed_maze(&gen, pm);
+    PROFILE_END(PHASE_CHUNK, start);
+    return result;
+}
+
+/**
+ * Generates the chunks asked for in the prefetch slots of the world
+ * until it stops.
+ */
+void *prefetch_worker(void *p){
+    struct world *world = (struct world*)p;
+    unsigned int i;
+
+    pthread_mutex_lock(&world->lock);
+    while (!world->stop){
+        struct prefetch_slot *slot = NULL;
+        int failed;
+        for (i = 0; i < PREFETCH_SLOTS && slot == NULL; i++)
+            if (world->prefetch[i].state == PREFETCH_WANTED) slot = &world->prefetch[i];
+        if (slot == NULL){
+            pthread_cond_wait(&world->wake, &world->lock);
+            continue;
+        }
+        slot->state = PREFETCH_BUSY;
+        pthread_mutex_unlock(&world->lock);
+        failed = generate_chunk(world->seed, world->cell_size, slot->id, &slot->maze) != 0;
+        pthread_mutex_lock(&world->lock);
+        slot->state = failed ? PREFETCH_FREE : PREFETCH_READY;
+    }
+    pthread_mutex_unlock(&world->lock);
+    return NULL;
+}
+
+void free_world(struct world *world){
+    unsigned int i;
+    if (world->has_thread){
+        pthread_mutex_lock(&world->lock);
+        world->stop = 1;
+        pthread_cond_signal(&world->wake);
+        pthread_mutex_unlock(&world->lock);
+        pthread_join(world->thread, NULL);
+        world->has_thread = 0;
+    }
+    for (i = 0; i < PREFETCH_SLOTS; i++) free_packed_maze(&world->prefetch[i].maze);
+    if (world->chunks != NULL)
+        for (i = 0; i < world->capacity; i++) free_packed_maze(&world->chunks[i].maze);
+    pthread_cond_destroy(&world->wake);
+    pthread_mutex_destroy(&world->lock);
+    free(world->chunks);
+    free(world->buckets);
+    free(world->taken);
+    world->chunks = NULL;
+    world->buckets = NULL;
+    world->taken = NULL;
+}
+
+/**
+ * Sets up the endless world of seed with cells of cell_size chars,
+ * keeping at most capacity chunks, and starts its prefetch thread. When
+ * the thread cannot be started every chunk is generated when needed.
+ * Returns 0 on success, -1 if out of memory.
+ */
+int init_world(struct world *world, unsigned int cell_size, int seed, unsigned int capacity){
+    unsigned int i;
+
+    world->seed = seed;
+    world->cell_size = cell_size;
+    world->capacity = capacity;
+    for (world->num_buckets = 1; world->num_buckets < 2*capacity; world->num_buckets *= 2);
+    world->chunks = (struct chunk*)MAZE_MALLOC(capacity*sizeof(struct chunk));
+    world->buckets = (int*)MAZE_MALLOC(world->num_buckets*sizeof(int));
+    world->tick = 0;
+    world->last = NULL;
+    world->taken = NULL;
+    world->taken_capacity = 0;
+    world->num_taken = 0;
+    world->ahead_row = world->ahead_col = 0;
+    world->ahead_dx = world->ahead_dy = 0;
+    world->ahead_x0 = -1;
+    world->ahead_y0 = world->ahead_x1 = world->ahead_y1 = -1;
+    world->reach_rows = world->reach_cols = 0;
+    world->wait = 0;
+    world->missing = 0;
+    world->arrived = 0;
+    world->has_thread = 0;
+    world->stop = 0;
+    world->generated = 0;
+    world->prefetched = 0;
+    for (i = 0; i < PREFETCH_SLOTS; i++){
+        world->prefetch[i].state = PREFETCH_FREE;
+        init_packed_maze(&world->prefetch[i].maze);
+    }
+    pthread_mutex_init(&world->lock, NULL);
+    pthread_cond_init(&world->wake, NULL);
+    for (i = 0; world->chunks != NULL && i < capacity; i++){
+        world->chunks[i].used = 0;
+        init_packed_maze(&world->chunks[i].maze);
+    }
+    if (world->chunks == NULL || world->buckets == NULL){
+        free_world(world);
+        return -1;
+    }
+    for (i = 0; i < world->num_buckets; i++) world->buckets[i] = -1;
+    world->has_thread = pthread_create(&world->thread, NULL, prefetch_worker, world) == 0;
+    return 0;
+}
+
+/**
+ * Returns the slot of the taken set holding (row, col), or the empty
+ * slot where it would go.
+ */
+size_t taken_slot(const struct world *world, long row, long col){
+    size_t mask = world->taken_capacity - 1;
+    size_t i = mix64((uint64_t)row * 0x9e3779b97f4a7c15ULL ^ (uint64_t)col) & mask;
+    while (world->taken[i].row != 0 && (world->taken[i].row != row || world->taken[i].col != col))
+        i = (i+1) & mask;
+    return i;
+}
+
+int potion_taken(const struct world *world, long row, long col){
+    return world->num_taken > 0 && world->taken[taken_slot(world, row, col)].row != 0;
+}
+
+/**
+ * Records that the potion at (row, col) was collected, growing the set
+ * to keep it at most half full.
+ * Returns 0 on success, -1 if out of memory.
+ */
+int add_taken(struct world *world, long row, long col){
+    size_t i;
+    if (2*(world->num_taken+1) > world->taken_capacity){
+        struct position *old = world->taken;
+        size_t old_capacity = world->taken_capacity;
+        size_t capacity = old_capacity ? 2*old_capacity : 64;
+        struct position *bigger = (struct position*)MAZE_CALLOC(capacity, sizeof(*bigger));
+        if (bigger == NULL) return -1;
+        world->taken = bigger;
+        world->taken_capacity = capacity;
+        for (i = 0; i < old_capacity; i++)
+            if (old[i].row != 0) world->taken[taken_slot(world, old[i].row, old[i].col)] = old[i];
+        free(old);
+    }
+    i = taken_slot(world, row, col);
+    if (world->taken[i].row == 0){
+        world->taken[i] = (struct position){row, col};
+        world->num_taken++;
+    }
+    return 0;
+}
+
+/**
+ * Returns the matrix row and column of the first char of chunk id.
+ */
+void chunk_origin(const struct world *world, uint64_t id, long *row, long *col){
+    long side = (long)CHUNK_CELLS*(world->cell_size+1);
+    *row = (long)(id & 0xffffffff)*side;
+    *col = (long)(id >> 32)*side;
+}
+
+/**
+ * Returns the cached chunk id, or NULL if it is not cached.
+ */
+struct chunk *world_find(const struct world *world, uint64_t id){
+    int i = world->buckets[mix64(id) & (world->num_buckets-1)];
+    while (i >= 0 && world->chunks[i].id != id) i = world->chunks[i].next;
+    return i >= 0 ? &world->chunks[i] : NULL;
+}
+
+/**
+ * Moves pm into the cache as chunk id in place of the least recently
+ * used chunk, and drops its potions already collected.
+ */
+struct chunk *world_insert(struct world *world, uint64_t id, struct packed_maze *pm){
+    struct chunk *c = &world->chunks[0];
+    long row0, col0;
+    unsigned int i;
+    int *link;
+
+    for (i = 1; i < world->capacity && c->used != 0; i++)
+        if (world->chunks[i].used < c->used) c = &world->chunks[i];
+    if (c->used != 0){ // unlink the chunk dropped
+        link = &world->buckets[mix64(c->id) & (world->num_buckets-1)];
+        while (&world->chunks[*link] != c) link = &world->chunks[*link].next;
+        *link = c->next;
+    }
+    free_packed_maze(&c->maze);
+    c->maze = *pm;
+    init_packed_maze(pm);
+    c->id = id;
+    c->used = ++world->tick;
+    link = &world->buckets[mix64(id) & (world->num_buckets-1)];
+    c->next = *link;
+    *link = c - world->chunks;
+
+    chunk_origin(world, id, &row0, &col0);
+    for (i = c->maze.num_items; i-- > 0;){
+        struct item *it = &c->maze.items[i];
+        if (potion_taken(world, row0 + it->row, col0 + it->col)) take_item(&c->maze, it->row, it->col);
+    }
+    return c;
+}
+
+/**
+ * Moves the chunks the prefetch thread has ready into the cache.
+ */
+void world_collect(struct world *world){
+    unsigned int i;
+    if (!world->has_thread) return;
+    pthread_mutex_lock(&world->lock);
+    for (i = 0; i < PREFETCH_SLOTS; i++){
+        struct prefetch_slot *slot = &world->prefetch[i];
+        if (slot->state != PREFETCH_READY) continue;
+        if (world_find(world, slot->id) == NULL){
+            world_insert(world, slot->id, &slot->maze);
+            world->prefetched++;
+            world->arrived++;
+        }
+        free_packed_maze(&slot->maze);
+        slot->state = PREFETCH_FREE;
+    }
+    pthread_mutex_unlock(&world->lock);
+}
+
+/**
+ * Generates chunk id on the spot and moves it into the cache.
+ * Returns the chunk, or NULL if out of memory.
+ */
+struct chunk *world_load(struct world *world, uint64_t id){
+    struct packed_maze pm;
+    init_packed_maze(&pm);
+    if (generate_chunk(world->seed, world->cell_size, id, &pm) != 0) return NULL;
+    world->generated++;
+    return world_insert(world, id, &pm);
+}
+
+/**
+ * Asks the prefetch thread for chunk (cx, cy) unless it is cached or
+ * already asked for.
+ * Returns 0 on success, -1 if every slot is taken.
+ */
+int world_prefetch(struct world *world, uint64_t cx, uint64_t cy){
+    uint64_t id = chunk_id(cx, cy);
+    struct prefetch_slot *free_slot = NULL;
+    unsigned int i;
+    int result = 0;
+
+    if (cx >= WORLD_CHUNKS || cy >= WORLD_CHUNKS || world_find(world, id) != NULL) return 0;
+    pthread_mutex_lock(&world->lock);
+    for (i = 0; i < PREFETCH_SLOTS; i++){
+        if (world->prefetch[i].state != PREFETCH_FREE && world->prefetch[i].id == id) break;
+        if (world->prefetch[i].state == PREFETCH_FREE && free_slot == NULL) free_slot = &world->prefetch[i];
+    }
+    if (i == PREFETCH_SLOTS && free_slot != NULL){
+        free_slot->id = id;
+        free_slot->state = PREFETCH_WANTED;
+        pthread_cond_signal(&world->wake);
+    }else if (i == PREFETCH_SLOTS){
+        result = -1;
+    }
+    pthread_mutex_unlock(&world->lock);
+    return result;
+}
+
+/**
+ * Returns chunk (cx, cy), or NULL if it is not ready yet or out of
+ * memory. A chunk neither cached nor ready is asked of the prefetch
+ * thread and missing is set; with wait, or without the thread, it is
+ * generated on the spot instead. The pointer is good until the next
+ * lookup.
+ */
+struct chunk *world_chunk(struct world *world, uint64_t cx, uint64_t cy){
+    uint64_t id = chunk_id(cx, cy);
+    struct chunk *c = world->last;
+
+    if (c == NULL || c->id != id){
+        if ((c = world_find(world, id)) == NULL){
+            world_collect(world);
+            c = world_find(world, id);
+        }
+        if (c == NULL && world->has_thread && !world->wait){
+            world_prefetch(world, cx, cy);
+            world->missing = 1;
+            return NULL;
+        }
+        if (c == NULL && (c = world_load(world, id)) == NULL) return NULL;
+        world->last = c;
+    }
+    c->used = ++world->tick;
+    return c;
+}
+
+/**
+ * Collects the chunks ready and asks for those the player at (row, col)
+ * going (dx, dy) may need next: every chunk a frame can show after one
+ * more step (see world_set_view), then the PREFETCH_AHEAD rows of them
+ * beyond, in the direction of the player. Nothing is asked again while
+ * those stay the same chunks.
+ */
+void world_look_ahead(struct world *world, long row, long col, long dx, long dy){
+    long side = (long)CHUNK_CELLS*(world->cell_size+1);
+    long x0 = (col-2-world->reach_cols)/side, x1 = (col+world->reach_cols)/side;
+    long y0 = (row-2-world->reach_rows)/side, y1 = (row+world->reach_rows)/side;
+    long k, j;
+    int failed = 0;
+
+    if (x0 == world->ahead_x0 && y0 == world->ahead_y0 && x1 == world->ahead_x1 && y1 == world->ahead_y1
+            && dx == world->ahead_dx && dy == world->ahead_dy){
+        world->ahead_row = row;
+        world->ahead_col = col;
+        world_collect(world);
+        return;
+    }
+    world->ahead_row = row;
+    world->ahead_col = col;
+    world->ahead_dx = dx;
+    world->ahead_dy = dy;
+    if (!world->has_thread) return;
+    world_collect(world);
+    for (k = y0; k <= y1; k++)
+        for (j = x0; j <= x1; j++) failed |= world_prefetch(world, j, k);
+    for (k = 1; k <= PREFETCH_AHEAD && (dx != 0 || dy != 0); k++){
+        if (dx != 0)
+            for (j = y0; j <= y1; j++) failed |= world_prefetch(world, (dx > 0 ? x1 : x0) + dx*k, j);
+        else
+            for (j = x0; j <= x1; j++) failed |= world_prefetch(world, j, (dy > 0 ? y1 : y0) + dy*k);
+    }
+    world->ahead_x0 = failed ? -1 : x0; // slots were full, ask again on the next step
+    world->ahead_y0 = y0;
+    world->ahead_x1 = x1;
+    world->ahead_y1 = y1;
+}
+
+/**
+ * Tells the world that a frame shows rows x cols positions. The camera
+ * keeps the player in the view, so no position farther than that from
+ * the player is shown; the chunks a new size shows are asked for.
+ */
+void world_set_view(struct world *world, long rows, long cols){
+    if (rows == world->reach_rows && cols == world->reach_cols) return;
+    world->reach_rows = rows;
+    world->reach_cols = cols;
+    world_look_ahead(world, world->ahead_row, world->ahead_col, world->ahead_dx, world->ahead_dy);
+}
+
+/**
+ * Returns the char at (row, col) of the world, items included, or a
+ * blank for an unexplored chunk, one not ready yet.
+ */
+char world_char_at(struct world *world, long row, long col){
+    long cs = world->cell_size, p = cs+1;
+    long size = world_matrix_size(world);
+    long gx, gy, rx, ry, row0, col0;
+    uint64_t id;
+    struct chunk *c;
+
+    if (row <= 0 || col <= 0 || row >= size-1 || col >= size-1) return WALL;
+    gy = (row-1)/p;
+    ry = (row-1)%p;
+    gx = (col-1)/p;
+    rx = (col-1)%p;
+    if ((c = world_chunk(world, gx/CHUNK_CELLS, gy/CHUNK_CELLS)) == NULL) return ' ';
+    if (rx == cs && ry == cs) return WALL;
+    id = c->id;
+    if (rx == cs && gx%CHUNK_CELLS == CHUNK_CELLS-1) // east border of the chunk
+        return gy%CHUNK_CELLS == border_opening(world, id, 0) ? ' ' : WALL;
+    if (ry == cs && gy%CHUNK_CELLS == CHUNK_CELLS-1) // south border
+        return gx%CHUNK_CELLS == border_opening(world, id, 1) ? ' ' : WALL;
+    chunk_origin(world, id, &row0, &col0);
+    return packed_char_at(&c->maze, row-row0, col-col0);
+}
+
+/**
+ * Returns whether (row, col) of the world blocks movement: a wall, or a
+ * chunk not ready yet.
+ */
+int world_is_wall(struct world *world, long row, long col){
+    long cs = world->cell_size, p = cs+1;
+    long size = world_matrix_size(world);
+    if (row <= 0 || col <= 0 || row >= size-1 || col >= size-1) return 1;
+    if (world_chunk(world, (col-1)/p/CHUNK_CELLS, (row-1)/p/CHUNK_CELLS) == NULL) return 1;
+    if ((row-1)%p < cs && (col-1)%p < cs) return 0;
+    return world_char_at(world, row, col) == WALL;
+}
+
+/**
+ * Removes the item at (row, col) from the world and returns its kind,
+ * or 0 if there was no item. A potion that cannot be recorded as taken
+ * comes back if its chunk is dropped and generated again.
+ */
+char world_take_item(struct world *world, long row, long col){
+    long p = world->cell_size+1;
+    long gx = (col-1)/p, gy = (row-1)/p;
+    long row0, col0;
+    struct chunk *c;
+    char kind;
+
+    if (world_is_wall(world, row, col) || (c = world_chunk(world, gx/CHUNK_CELLS, gy/CHUNK_CELLS)) == NULL) return 0;
+    chunk_origin(world, c->id, &row0, &col0);
+    if ((kind = take_item(&c->maze, row-row0, col-col0)) != 0) add_taken(world, row, col);
+    return kind;
+}
+
+//-----------------------------------------------------------------------------
+
+/**
+ * What the player can see. Without line of sight it is the square of
+ * radius positions around the player; with it, only the positions rays
+ * from the player reach before they hit a wall.
+ * explored has a bit for every position seen so far. It is kept in
+ * blocks of 64x64 positions, allocated the first time one of their
+ * positions is seen, so it grows with the explored area and not with the
+ * maze.
+ */
+struct fog{
+    int radius;           // 0 when there is no fog
+    int line_of_sight;
+    int remember;         // keep explored positions drawn outside the fog-free area
+    unsigned char *sight; // with line of sight, (2*radius+1)^2 flags around the player
+    uint64_t **explored;  // blocks_x*blocks_y blocks of 64 rows, or NULL
+    long blocks_x, blocks_y;
+};
+
+#define HINT_MAX_POTIONS 16
+
+/**
+ * Distance fields of the exit and of the potions left in the maze, for
+ * the hint key and the steps left shown on the status line. The field of
+ * a potion is dropped when the potion is picked up. Mazes whose fields
+ * would take more than HINT_MEMORY_LIMIT bytes, or with more than
+ * HINT_MAX_POTIONS potions, get no hints.
+ * The potions do not move, so the best way on from each of them is
+ * planned when the game starts and at every pickup (see plan_hints),
+ * and a move only looks up the distance to each potion left.
+ */
+struct hints{
+    int enabled;
+    struct distance_field exit;
+    struct distance_field *potions;
+    unsigned int num_potions;
+    int needed; // potions still needed when last planned
+    uint64_t between[HINT_MAX_POTIONS][HINT_MAX_POTIONS+1]; // from potion to potion, the last column to the exit
+    uint64_t tail[HINT_MAX_POTIONS];   // fewest steps from a potion through needed-1 others to the exit
+    unsigned char used[HINT_MAX_POTIONS]; // a flag per potion for search_tail
+    uint64_t steps_left; // of the shortest way to win from the player, NO_PATH if none
+    char text[32];       // the last hint
+};
+
+#define HINT_MEMORY_LIMIT ((size_t)1 << 30)
+
+/**
+ * State of a game being played on a packed maze, or in an endless world
+ * when world is not NULL.
+ */
+struct game{
+    struct packed_maze *maze; // NULL in an endless world
+    struct world *world;
+    long player_x; // matrix column of the player
+    long player_y; // matrix row of the player
+    int potions_collected;
+    struct fog fog;
+    struct hints hints;
+    int escaped;
+    const char *message; // shown on the status line until the next move
+};
+
+long game_matrix_width(const struct game *game){
+    return game->world ? world_matrix_size(game->world) : (long)packed_matrix_width(game->maze);
+}
+
+long game_matrix_height(const struct game *game){
+    return game->world ? world_matrix_size(game->world) : (long)packed_matrix_height(game->maze);
+}
+
+/**
+ * Returns whether (row, col) of the maze or world blocks movement.
+ */
+int game_is_wall(const struct game *game, long row, long col){
+    if (game->world) return world_is_wall(game->world, row, col);
+    return packed_is_wall(game->maze, row, col);
+}
+
+/**
+ * Returns the char at (row, col) of the maze or world, items included.
+ */
+char game_char_at(const struct game *game, long row, long col){
+    if (game->world) return world_char_at(game->world, row, col);
+    return packed_char_at(game->maze, row, col);
+}
+
+/**
+ * Returns whether (row, col) is inside the square of the fog around the
+ * player.
+ */
+int in_fog_window(const struct game *game, long row, long col){
+    long radius = game->fog.radius;
+    return labs(row-game->player_y) <= radius && labs(col-game->player_x) <= radius;
+}
+
+/**
+ * Returns whether (row, col) is outside the fog.
+ */
+int game_visible(const struct game *game, long row, long col){
+    const struct fog *fog = &game->fog;
+    long side = 2*fog->radius+1;
+    if (fog->radius == 0) return 1;
+    if (!in_fog_window(game, row, col)) return 0;
+    if (!fog->line_of_sight) return 1;
+    return fog->sight[(row-game->player_y+fog->radius)*side + col-game->player_x+fog->radius];
+}
+
+/**
+ * Returns whether (row, col) has been seen, see struct fog.
+ */
+int explored_get(const struct fog *fog, long row, long col){
+    uint64_t *block;
+    if (row < 0 || col < 0 || row/64 >= fog->blocks_y || col/64 >= fog->blocks_x) return 0;
+    block = fog->explored[row/64*fog->blocks_x + col/64];
+    return block != NULL && (block[row%64] >> (col%64) & 1);
+}
+
+/**
+ * Records that (row, col) has been seen. When the block of the position
+ * cannot be allocated it stays unexplored.
+ */
+void explored_set(struct fog *fog, long row, long col){
+    uint64_t **block;
+    if (row < 0 || col < 0 || row/64 >= fog->blocks_y || col/64 >= fog->blocks_x) return;
+    block = &fog->explored[row/64*fog->blocks_x + col/64];
+    if (*block == NULL && (*block = MAZE_CALLOC(64, sizeof(**block))) == NULL) return;
+    (*block)[row%64] |= (uint64_t)1 << (col%64);
+}
+
+/**
+ * Casts a ray from the player to (player_y+dy, player_x+dx), marking the
+ * positions it passes in sight up to and including the first wall.
+ */
+void cast_ray(struct game *game, long dx, long dy){
+    struct fog *fog = &game->fog;
+    long side = 2*fog->radius+1;
+    long steps = labs(dx) > labs(dy) ? labs(dx) : labs(dy);
+    long i;
+
+    for (i = 1; i <= steps; i++){ // Bresenham-like, rounding to the nearest position
+        long x = (2*dx*i + (dx < 0 ? -steps : steps)) / (2*steps);
+        long y = (2*dy*i + (dy < 0 ? -steps : steps)) / (2*steps);
+        fog->sight[(y+fog->radius)*side + x+fog->radius] = 1;
+        if (game_is_wall(game, game->player_y+y, game->player_x+x)) break;
+    }
+}
+
+/**
+ * Recomputes the line of sight around the player by casting a ray to
+ * every position on the border of the fog square, O(radius^2).
+ */
+void update_sight(struct game *game){
+    struct fog *fog = &game->fog;
+    long side = 2*fog->radius+1;
+    long r = fog->radius;
+    long i;
+
+    memset(fog->sight, 0, side*side);
+    fog->sight[r*side+r] = 1;
+    for (i = -r; i <= r; i++){
+        cast_ray(game, i, -r);
+        cast_ray(game, i, r);
+        cast_ray(game, -r, i);
+        cast_ray(game, r, i);
+    }
+}
+
+/**
+ * Marks the visible positions among those of the fog square whose row
+ * is in [row0, row1] and column in [col0, col1] as explored.
+ */
+void explore_rect(struct game *game, long row0, long row1, long col0, long col1){
+    long row, col;
+    for (row = row0; row <= row1; row++)
+        for (col = col0; col <= col1; col++)
+            if (game_visible(game, row, col)) explored_set(&game->fog, row, col);
+}
+
+/**
+ * Brings the fog up to date after the player stepped by (dx, dy) or,
+ * when both are 0, was placed. Without line of sight a step only
+ * uncovers the row or column on the leading edge of the fog square, so
+ * only those radius*2+1 positions are explored.
+ */
+void update_fog(struct game *game, long dx, long dy){
+    struct fog *fog = &game->fog;
+    long r = fog->radius;
+    long x = game->player_x;
+    long y = game->player_y;
+
+    if (r == 0) return;
+    if (fog->line_of_sight) update_sight(game);
+    if (fog->explored == NULL) return;
+    if (fog->line_of_sight || (dx == 0 && dy == 0)){
+        explore_rect(game, y-r, y+r, x-r, x+r);
+        return;
+    }
+    if (dy != 0) explore_rect(game, y+dy*r, y+dy*r, x-r, x+r);
+    if (dx != 0) explore_rect(game, y-r, y+r, x+dx*r, x+dx*r);
+}
+
+void free_fog(struct fog *fog){
+    long i;
+    if (fog->explored != NULL)
+        for (i = 0; i < fog->blocks_x*fog->blocks_y; i++) free(fog->explored[i]);
+    free(fog->explored);
+    free(fog->sight);
+    fog->explored = NULL;
+    fog->sight = NULL;
+}
+
+void free_hints(struct hints *h){
+    unsigned int i;
+    if (h->enabled) free_distance_field(&h->exit);
+    for (i = 0; i < h->num_potions; i++) free_distance_field(&h->potions[i]);
+    free(h->potions);
+    h->enabled = 0;
+    h->potions = NULL;
+    h->num_potions = 0;
+}
+
+/**
+ * Returns the fewest steps from potion p through needed potions not used
+ * yet to the exit, or best if it is not less, trying every order of the
+ * potions; steps is the length of the way to p. Each distance is in
+ * h->between, so no search of the maze is made.
+ */
+uint64_t search_tail(struct hints *h, unsigned int p, int needed, uint64_t steps, uint64_t best){
+    unsigned int q;
+    uint64_t c;
+
+    if (steps >= best) return best;
+    if (needed <= 0){
+        c = h->between[p][HINT_MAX_POTIONS];
+        return c == NO_PATH || steps + c >= best ? best : steps + c;
+    }
+    for (q = 0; q < h->num_potions; q++){
+        if (h->used[q] || (c = h->between[p][q]) == NO_PATH) continue;
+        h->used[q] = 1;
+        best = search_tail(h, q, needed-1, steps + c, best);
+        h->used[q] = 0;
+    }
+    return best;
+}
+
+/**
+ * Fills the distances between the potions left and from them to the
+ * exit, then the tail of each potion: the fewest steps on from it
+ * through needed-1 other potions to the exit.
+ */
+void plan_hints(struct hints *h, const struct packed_maze *pm, int needed){
+    enum direction d;
+    unsigned int p, q;
+
+    h->needed = needed;
+    if (!h->enabled || needed <= 0) return;
+    for (p = 0; p < h->num_potions; p++){
+        for (q = 0; q < h->num_potions; q++)
+            h->between[p][q] = p == q ? NO_PATH : field_distance(&h->potions[q], pm, h->potions[p].target, &d);
+        h->between[p][HINT_MAX_POTIONS] = field_distance(&h->exit, pm, h->potions[p].target, &d);
+        h->used[p] = 0;
+    }
+    for (p = 0; p < h->num_potions; p++){
+        h->used[p] = 1;
+        h->tail[p] = search_tail(h, p, needed-1, 0, NO_PATH);
+        h->used[p] = 0;
+    }
+}
+
+/**
+ * Computes the distance fields of pm into h, unless enabled is 0 or the
+ * maze is too big or has too many potions for them (see struct hints).
+ * Returns 0 on success, -1 if out of memory.
+ */
+int init_hints(struct hints *h, const struct packed_maze *pm, int enabled){
+    struct position exit;
+    unsigned int i;
+
+    h->enabled = 0;
+    h->potions = NULL;
+    h->num_potions = 0;
+    h->needed = NEEDED_POTIONS;
+    h->steps_left = NO_PATH;
+    h->text[0] = '\0';
+    if (!enabled || num_cells(pm) == 0 || pm->num_items > HINT_MAX_POTIONS ||
+            distance_field_size(pm) > HINT_MEMORY_LIMIT/(pm->num_items+1))
+        return 0;
+    exit.row = packed_matrix_height(pm)-2;
+    exit.col = packed_matrix_width(pm)-1;
+    if (init_distance_field(&h->exit, pm, exit) != 0) return -1;
+    h->enabled = 1;
+    h->potions = MAZE_MALLOC((pm->num_items+1)*sizeof(*h->potions));
+    if (h->potions == NULL){
+        free_hints(h);
+        return -1;
+    }
+    for (i = 0; i < pm->num_items; i++){
+        if (pm->items[i].kind != POTION) continue;
+        if (init_distance_field(&h->potions[h->num_potions], pm, (struct position){pm->items[i].row, pm->items[i].col}) != 0){
+            free_hints(h);
+            return -1;
+        }
+        h->num_potions++;
+    }
+    plan_hints(h, pm, NEEDED_POTIONS);
+    return 0;
+}
+
+/**
+ * Drops the distance field of the potion picked up at (row, col) and
+ * plans again for the needed potions left.
+ */
+void hints_take_potion(struct hints *h, const struct packed_maze *pm, long row, long col, int needed){
+    unsigned int i;
+    for (i = 0; i < h->num_potions; i++){
+        if (h->potions[i].target.row != row || h->potions[i].target.col != col) continue;
+        free_distance_field(&h->potions[i]);
+        h->potions[i] = h->potions[--h->num_potions];
+        plan_hints(h, pm, needed);
+        return;
+    }
+}
+
+/**
+ * Updates the steps left to win the game from where the player stands:
+ * the best of the way to each potion left and its planned tail, one
+ * field lookup per potion.
+ */
+void update_hints(struct game *game){
+    struct hints *h = &game->hints;
+    struct position pos = {game->player_y, game->player_x};
+    enum direction d;
+    unsigned int p;
+    uint64_t c, best = NO_PATH;
+
+    if (!h->enabled) return;
+    if (h->needed <= 0){
+        h->steps_left = field_distance(&h->exit, game->maze, pos, &d);
+        return;
+    }
+    for (p = 0; p < h->num_potions; p++){
+        if (h->tail[p] == NO_PATH || (c = field_distance(&h->potions[p], game->maze, pos, &d)) == NO_PATH) continue;
+        if (c == 0) c = 2; // standing on it: step off and back
+        if (c + h->tail[p] < best) best = c + h->tail[p];
+    }
+    h->steps_left = best;
+}
+
+/**
+ * Shows on the status line the key of the next step towards the nearest
+ * potion left, or towards the exit once enough potions are collected.
+ */
+void show_hint(struct game *game){
+    static const char *names[] = {"up", "left", "right", "down"};
+    struct hints *h = &game->hints;
+    struct position pos = {game->player_y, game->player_x};
+    enum direction d, next = DIR_UP;
+    uint64_t best = NO_PATH, c;
+    unsigned int i;
+
+    if (!h->enabled) return;
+    if (game->potions_collected >= NEEDED_POTIONS){
+        best = field_distance(&h->exit, game->maze, pos, &next);
+    }else{
+        for (i = 0; i < h->num_potions; i++){
+            c = field_distance(&h->potions[i], game->maze, pos, &d);
+            if (c == 0 || c >= best) continue; // one the player stands on is no way forward
+            best = c;
+            next = d;
+        }
+    }
+    if (best == NO_PATH || best == 0) snprintf(h->text, sizeof(h->text), "Hint: no way to go");
+    else snprintf(h->text, sizeof(h->text), "Hint: go %s (%c)", names[next], direction_key(next));
+    game->message = h->text;
+}
+
+/**
+ * Sets up the fog of radius over a matrix of mw x mh positions.
+ * Without line of sight a fog radius reaching past the matrix hides
+ * nothing and counts as no fog.
+ * Returns 0 on success, -1 if out of memory.
+ */
+int init_fog(struct fog *fog, long mw, long mh, int radius, int line_of_sight, int remember){
+    if (radius < 0) radius = 0;
+    if (line_of_sight){
+        if (radius > mw && radius > mh) radius = mw > mh ? mw : mh;
+    }else if (radius >= mh-1 || radius >= mw-1){
+        radius = 0;
+    }
+    fog->radius = radius;
+    fog->line_of_sight = line_of_sight && radius > 0;
+    fog->remember = remember && radius > 0;
+    fog->sight = NULL;
+    fog->explored = NULL;
+    fog->blocks_x = (mw+63)/64;
+    fog->blocks_y = (mh+63)/64;
+    if (fog->line_of_sight &&
+            (fog->sight = MAZE_MALLOC((size_t)(2*radius+1)*(2*radius+1))) == NULL)
+        return -1;
+    if (fog->remember &&
+            (fog->explored = MAZE_CALLOC((size_t)fog->blocks_x*fog->blocks_y, sizeof(*fog->explored))) == NULL){
+        free_fog(fog);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Starts a game on maze with the player at the entry. hints is 0 for a
+ * game without the hint key and the steps left.
+ * Returns 0 on success, -1 if out of memory; either way game can be
+ * given to free_game.
+ */
+int init_game(struct game *game, struct packed_maze *maze, int fog_radius, int line_of_sight, int remember, int hints){
+    game->maze = maze;
+    game->world = NULL;
+    game->player_x = 0;
+    game->player_y = 1;
+    game->potions_collected = 0;
+    game->escaped = 0;
+    game->message = NULL;
+    init_hints(&game->hints, NULL, 0); // no hints yet, for free_game if the fog fails
+    if (init_fog(&game->fog, packed_matrix_width(maze), packed_matrix_height(maze),
+                 fog_radius, line_of_sight, remember) != 0)
+        return -1;
+    if (init_hints(&game->hints, maze, hints) != 0){
+        free_fog(&game->fog);
+        return -1;
+    }
+    update_fog(game, 0, 0);
+    update_hints(game);
+    return 0;
+}
+
+/**
+ * Starts a game in world with the player in the first cell of the middle
+ * chunk, generated on the spot so the player is never in an unexplored
+ * one. An endless world has no exit, no hints, and explored positions
+ * are not remembered, since their bitmap would grow without end.
+ * Returns 0 on success, -1 if out of memory; either way game can be
+ * given to free_game.
+ */
+int init_endless_game(struct game *game, struct world *world, int fog_radius, int line_of_sight){
+    long start = 1 + (long)(WORLD_CHUNKS/2)*CHUNK_CELLS*(world->cell_size+1);
+    uint64_t id = chunk_id(WORLD_CHUNKS/2, WORLD_CHUNKS/2);
+    game->maze = NULL;
+    game->world = world;
+    game->player_x = start;
+    game->player_y = start;
+    game->potions_collected = 0;
+    game->escaped = 0;
+    game->message = NULL;
+    init_hints(&game->hints, NULL, 0);
+    if (init_fog(&game->fog, world_matrix_size(world), world_matrix_size(world), fog_radius, line_of_sight, 0) != 0)
+        return -1;
+    if (world_find(world, id) == NULL && world_load(world, id) == NULL){
+        free_fog(&game->fog);
+        return -1;
+    }
+    world_look_ahead(world, start, start, 0, 0);
+    update_fog(game, 0, 0);
+    return 0;
+}
+
+void free_game(struct game *game){
+    free_fog(&game->fog);
+    free_hints(&game->hints);
+}
+
+/**
+ * Moves the player one step in direction d unless a wall is in the way,
+ * picking up the potion there if any.
+ * Returns 1 if the player moved, 0 otherwise.
+ */
+int move_player(struct game *game, enum direction d){
+    long dy = (d == DIR_DOWN) - (d == DIR_UP);
+    long dx = (d == DIR_RIGHT) - (d == DIR_LEFT);
+    long row = game->player_y + dy;
+    long col = game->player_x + dx;
+    PROFILE_START(start);
+
+    if (game_is_wall(game, row, col)) return 0;
+    if ((game->world ? world_take_item(game->world, row, col) : take_item(game->maze, row, col)) == POTION){
+        game->potions_collected += 1;
+        hints_take_potion(&game->hints, game->maze, row, col, NEEDED_POTIONS - game->potions_collected);
+    }
+    game->player_x = col;
+    game->player_y = row;
+    game->message = NULL;
+    if (game->world){ // no exit, the chunks ahead are made instead
+        world_look_ahead(game->world, row, col, dx, dy);
+        update_fog(game, dx, dy);
+        PROFILE_END(PHASE_MOVE, start);
+        return 1;
+    }
+    update_fog(game, dx, dy);
+    update_hints(game);
+    if (col + 1 == packed_matrix_width(game->maze)){ // the player reached the exit
+        if (game->potions_collected >= NEEDED_POTIONS) game->escaped = 1;
+        else game->message = "You cannot exit before collecting all the potions!";
+    }
+    PROFILE_END(PHASE_MOVE, start);
+    return 1;
+}
+
+/**
+ * Stores the direction key moves the player in into *d.
+ * Returns 0 on success, -1 if key is not a movement key.
+ */
+int key_direction(int key, enum direction *d){
+    switch (key){
+        case MOVE_UP: *d = DIR_UP; return 0;
+        case MOVE_DOWN: *d = DIR_DOWN; return 0;
+        case MOVE_LEFT: *d = DIR_LEFT; return 0;
+        case MOVE_RIGHT: *d = DIR_RIGHT; return 0;
+        default: return -1;
+    }
+}
+
+/**
+ * Returns whether (row, col) is drawn: it is visible, or it was explored
+ * and the fog remembers.
+ */
+int game_shown(const struct game *game, long row, long col){
+    if (game_visible(game, row, col)) return 1;
+    return game->fog.remember && explored_get(&game->fog, row, col);
+}
+
+/**
+ * Returns the char shown at (row, col): the player or the maze content.
+ */
+char display_char(const struct game *game, long row, long col){
+    if (row == game->player_y && col == game->player_x) return PLAYER;
+    return game_char_at(game, row, col);
+}
+
+/**
+ * Where a renderer draws: put, put_line and clear_all change the screen and
+ * flush shows the frame. bytes counts what has been sent to the terminal,
+ * or for a backend without one what a terminal would have been sent.
+ * The ncurses backend draws on the terminal; the memory backend draws
+ * into a framebuffer and needs no terminal at all.
+ */
+struct render_backend{
+    void (*size)(struct render_backend *b, int *rows, int *cols);
+    void (*put)(struct render_backend *b, int row, int col, char c);
+    void (*put_line)(struct render_backend *b, int row, const char *text); // clears the rest of the line
+    void (*clear_all)(struct render_backend *b);
+    void (*flush)(struct render_backend *b);
+    void (*close)(struct render_backend *b);
+    unsigned long bytes;
+    void *data; // state of the backend
+};
+
+/**
+ * State of the ncurses backend. ncurses writes straight to the terminal,
+ * so its bytes are counted from the bytes the process has written, read
+ * from /proc/self/io.
+ */
+struct terminal{
+    int io_fd; // open on /proc/self/io, or -1
+    unsigned long written; // bytes the process had written at the last flush
+};
+
+/**
+ * Returns the bytes the process has written so far, or 0 if unknown.
+ */
+unsigned long written_bytes(const struct terminal *t){
+    char buf[512];
+    char *field;
+    ssize_t n;
+    if (t->io_fd < 0 || (n = pread(t->io_fd, buf, sizeof(buf)-1, 0)) <= 0) return 0;
+    buf[n] = '\0';
+    field = strstr(buf, "wchar:");
+    return field ? strtoul(field+6, NULL, 10) : 0;
+}
+
+void curses_size(struct render_backend *b, int *rows, int *cols){
+    (void)b;
+    getmaxyx(stdscr, *rows, *cols);
+}
+
+void curses_put(struct render_backend *b, int row, int col, char c){
+    (void)b;
+    mvaddch(row, col, c);
+}
+
+void curses_put_line(struct render_backend *b, int row, const char *text){
+    int rows, cols;
+    b->size(b, &rows, &cols);
+    mvaddnstr(row, 0, text, cols);
+    clrtoeol();
+}
+
+void curses_clear(struct render_backend *b){
+    (void)b;
+    clear();
+}
+
+void curses_flush(struct render_backend *b){
+    struct terminal *t = b->data;
+    unsigned long written;
+    refresh();
+    written = written_bytes(t);
+    b->bytes += written - t->written;
+    t->written = written;
+}
+
+void curses_close(struct render_backend *b){
+    struct terminal *t = b->data;
+    endwin();
+    if (t->io_fd >= 0) close(t->io_fd);
+    t->io_fd = -1;
+}
+
+/**
+ * Starts ncurses on the terminal, t keeping the state of the backend.
+ */
+void init_curses_backend(struct render_backend *b, struct terminal *t){
+    b->size = curses_size;
+    b->put = curses_put;
+    b->put_line = curses_put_line;
+    b->clear_all = curses_clear;
+    b->flush = curses_flush;
+    b->close = curses_close;
+    b->bytes = 0;
+    b->data = t;
+    initscr();
+    cbreak();
+    noecho();
+    t->io_fd = open("/proc/self/io", O_RDONLY);
+    t->written = written_bytes(t);
+}
+
+/**
+ * Screen of the memory backend. The cursor is tracked to count the
+ * cursor movements a terminal would need.
+ */
+struct framebuffer{
+    int rows, cols;
+    char *cells; // rows*cols chars
+    int cursor_row, cursor_col;
+};
+
+/**
+ * Moves the cursor of the framebuffer, counting the bytes of an ANSI
+ * cursor position sequence if it is not already there.
+ */
+void framebuffer_move(struct render_backend *b, int row, int col){
+    struct framebuffer *fb = b->data;
+    char seq[32];
+    if (fb->cursor_row == row && fb->cursor_col == col) return;
+    b->bytes += snprintf(seq, sizeof(seq), "\033[%d;%dH", row+1, col+1);
+    fb->cursor_row = row;
+    fb->cursor_col = col;
+}
+
+void framebuffer_size(struct render_backend *b, int *rows, int *cols){
+    struct framebuffer *fb = b->data;
+    *rows = fb->rows;
+    *cols = fb->cols;
+}
+
+void framebuffer_put(struct render_backend *b, int row, int col, char c){
+    struct framebuffer *fb = b->data;
+    framebuffer_move(b, row, col);
+    fb->cells[row*fb->cols+col] = c;
+    fb->cursor_col++;
+    b->bytes += 1;
+}
+
+void framebuffer_put_line(struct render_backend *b, int row, const char *text){
+    struct framebuffer *fb = b->data;
+    int n = strlen(text) < (size_t)fb->cols ? (int)strlen(text) : fb->cols;
+    framebuffer_move(b, row, 0);
+    memcpy(&fb->cells[row*fb->cols], text, n);
+    memset(&fb->cells[row*fb->cols+n], ' ', fb->cols-n);
+    fb->cursor_col = n;
+    b->bytes += n + 3; // and "\033[K"
+}
+
+void framebuffer_clear(struct render_backend *b){
+    struct framebuffer *fb = b->data;
+    memset(fb->cells, ' ', (size_t)fb->rows*fb->cols);
+    fb->cursor_row = 0;
+    fb->cursor_col = 0;
+    b->bytes += 7; // "\033[H\033[2J"
+}
+
+void framebuffer_flush(struct render_backend *b){
+    (void)b;
+}
+
+void framebuffer_close(struct render_backend *b){
+    struct framebuffer *fb = b->data;
+    free(fb->cells);
+    fb->cells = NULL;
+}
+
+/**
+ * Makes b draw into fb, a screen of rows x cols.
+ * Returns 0 on success, -1 if out of memory.
+ */
+int init_memory_backend(struct render_backend *b, struct framebuffer *fb, int rows, int cols){
+    fb->rows = rows;
+    fb->cols = cols;
+    fb->cursor_row = 0;
+    fb->cursor_col = 0;
+    fb->cells = MAZE_MALLOC((size_t)rows*cols);
+    if (fb->cells == NULL) return -1;
+    memset(fb->cells, ' ', (size_t)rows*cols);
+    b->size = framebuffer_size;
+    b->put = framebuffer_put;
+    b->put_line = framebuffer_put_line;
+    b->clear_all = framebuffer_clear;
+    b->flush = framebuffer_flush;
+    b->close = framebuffer_close;
+    b->bytes = 0;
+    b->data = fb;
+    return 0;
+}
+
+/**
+ * Draws a game through a backend, writing only the chars that changed.
+ * shadow holds what is on the screen and moves mark the positions they
+ * may have changed, so a frame costs as much as the dirty positions and
+ * not as much as the maze or the screen.
+ * The screen shows the part of the maze under a camera that follows the
+ * player, with the status line below it.
+ */
+struct renderer{
+    int rows, cols;   // size of the screen
+    char *shadow;     // rows*cols chars currently on the screen
+    char status[128]; // status line currently on the screen
+    long *dirty;      // row, col pairs of matrix positions to redraw
+    size_t num_dirty;
+    size_t max_dirty;
+    int full;         // redraw every position on the next frame
+    long cam_row;     // matrix position shown at the top left of the screen
+    long cam_col;
+    struct render_backend *backend;
+    int holes;              // unexplored chunks of an endless world are on the screen
+    unsigned long arrived;  // world->arrived when the last frame was drawn
+    unsigned long frames; // frames drawn so far
+    uint64_t render_ns;   // time spent drawing them
+};
+
+/**
+ * Fits the shadow to the current size of the screen and schedules a
+ * full redraw.
+ * Returns 0 on success, -1 if out of memory.
+ */
+int renderer_resize(struct renderer *r){
+    char *shadow;
+    r->backend->size(r->backend, &r->rows, &r->cols);
+    shadow = MAZE_REALLOC(r->shadow, (size_t)r->rows*r->cols);
+    if (shadow == NULL) return -1;
+    r->shadow = shadow;
+    memset(r->shadow, ' ', (size_t)r->rows*r->cols);
+    r->status[0] = '\0';
+    r->full = 1;
+    r->backend->clear_all(r->backend);
+    return 0;
+}
+
+/**
+ * Starts drawing through backend, clearing the screen.
+ * Returns 0 on success, -1 if out of memory.
+ */
+int init_renderer(struct renderer *r, struct render_backend *backend){
+    r->backend = backend;
+    r->frames = 0;
+    r->render_ns = 0;
+    r->shadow = NULL;
+    r->dirty = NULL;
+    r->num_dirty = 0;
+    r->max_dirty = 0;
+    r->cam_row = 0;
+    r->cam_col = 0;
+    r->holes = 0;
+    r->arrived = 0;
+    return renderer_resize(r);
+}
+
+void free_renderer(struct renderer *r){
+    free(r->shadow);
+    free(r->dirty);
+    r->shadow = NULL;
+    r->dirty = NULL;
+}
+
+/**
+ * Marks matrix position (row, col) to be redrawn on the next frame.
+ */
+void renderer_mark(struct renderer *r, long row, long col){
+    if (r->num_dirty == r->max_dirty){
+        size_t max_dirty = r->max_dirty ? r->max_dirty*2 : 64;
+        long *dirty = MAZE_REALLOC(r->dirty, max_dirty*2*sizeof(*dirty));
+        if (dirty == NULL){ // fall back to checking every position
+            r->full = 1;
+            r->num_dirty = 0;
+            return;
+        }
+        r->dirty = dirty;
+        r->max_dirty = max_dirty;
+    }
+    r->dirty[r->num_dirty*2] = row;
+    r->dirty[r->num_dirty*2+1] = col;
+    r->num_dirty++;
+}
+
+/**
+ * Marks what a one step move of the player from (old_y, old_x) changes:
+ * both player positions, and with fog the row or column of the fog-free
+ * square the player left behind and the one it stepped into. With line
+ * of sight both squares are marked.
+ */
+void renderer_mark_move(struct renderer *r, const struct game *game, long old_x, long old_y){
+    long radius = game->fog.radius;
+    long dx = game->player_x - old_x;
+    long dy = game->player_y - old_y;
+    long i, j;
+
+    renderer_mark(r, old_y, old_x);
+    renderer_mark(r, game->player_y, game->player_x);
+    if (radius == 0) return;
+    if (game->fog.line_of_sight){ // anything in both squares may have changed
+        for (i = -radius; i <= radius; i++)
+            for (j = -radius; j <= radius; j++){
+                renderer_mark(r, old_y + i, old_x + j);
+                if (labs(i + dy) > radius || labs(j + dx) > radius)
+                    renderer_mark(r, game->player_y + i, game->player_x + j);
+            }
+        return;
+    }
+    for (i = -radius; i <= radius; i++){
+        if (dy != 0){
+            renderer_mark(r, old_y - dy*radius, old_x + i);
+            renderer_mark(r, game->player_y + dy*radius, game->player_x + i);
+        }
+        if (dx != 0){
+            renderer_mark(r, old_y + i, old_x - dx*radius);
+            renderer_mark(r, game->player_y + i, game->player_x + dx*radius);
+        }
+    }
+}
+
+/**
+ * Number of screen rows showing the maze. The status line is right
+ * below them.
+ */
+int view_rows(const struct renderer *r, const struct game *game){
+    long mh = game_matrix_height(game);
+    return mh < r->rows-1 ? mh : r->rows-1;
+}
+
+/**
+ * Number of screen columns showing the maze.
+ */
+int view_cols(const struct renderer *r, const struct game *game){
+    long mw = game_matrix_width(game);
+    return mw < r->cols ? mw : r->cols;
+}
+
+/**
+ * Returns the camera position on one axis for a view of view positions
+ * over a maze of size positions. The camera does not move while the
+ * player is more than a quarter of the view away from its edges, and
+ * then centers on the player, so most steps do not scroll.
+ */
+long camera_axis(long cam, long player, long view, long size){
+    long margin = view/4;
+    if (player - cam < margin || player - cam >= view - margin) cam = player - view/2;
+    if (cam > size - view) cam = size - view;
+    if (cam < 0) cam = 0;
+    return cam;
+}
+
+/**
+ * Brings matrix position (row, col) up to date on the screen if it is
+ * under the camera and shows something else.
+ */
+void draw_position(struct renderer *r, const struct game *game, long row, long col){
+    long screen_row = row - r->cam_row;
+    long screen_col = col - r->cam_col;
+    char c = ' ';
+    char *shown;
+
+    if (screen_row < 0 || screen_col < 0 ||
+            screen_row >= view_rows(r, game) || screen_col >= view_cols(r, game))
+        return;
+    if (game_shown(game, row, col))
+        c = display_char(game, row, col);
+    shown = &r->shadow[screen_row*r->cols+screen_col];
+    if (*shown != c){
+        r->backend->put(r->backend, screen_row, screen_col, c);
+        *shown = c;
+    }
+}
+
+/**
+ * Draws the positions marked since the last frame and the status line.
+ * When the camera scrolls the whole view is checked against the shadow,
+ * which costs as much as the screen, not the maze. So is it once chunks
+ * arrived while unexplored ones were on the screen.
+ */
+void render_frame(struct renderer *r, const struct game *game){
+    char status[sizeof(r->status)];
+    uint64_t start = now_ns();
+    unsigned long bytes = r->backend->bytes;
+    size_t i;
+    int len;
+    long row, col;
+    long cam_row = camera_axis(r->cam_row, game->player_y, view_rows(r, game), game_matrix_height(game));
+    long cam_col = camera_axis(r->cam_col, game->player_x, view_cols(r, game), game_matrix_width(game));
+
+    if (cam_row != r->cam_row || cam_col != r->cam_col){
+        r->cam_row = cam_row;
+        r->cam_col = cam_col;
+        r->full = 1;
+    }
+    if (game->world != NULL){
+        world_set_view(game->world, view_rows(r, game), view_cols(r, game));
+        if (r->holes && game->world->arrived != r->arrived){
+            r->full = 1;
+            r->holes = 0;
+        }
+        r->arrived = game->world->arrived;
+        game->world->missing = 0;
+    }
+    if (r->full){
+        for (row = 0; row < view_rows(r, game); row++)
+            for (col = 0; col < view_cols(r, game); col++)
+                draw_position(r, game, r->cam_row + row, r->cam_col + col);
+        r->full = 0;
+    }else{
+        for (i = 0; i < r->num_dirty; i++)
+            draw_position(r, game, r->dirty[i*2], r->dirty[i*2+1]);
+    }
+    r->num_dirty = 0;
+    if (game->world != NULL) r->holes |= game->world->missing;
+
+    len = snprintf(status, sizeof(status), "Potions collected: %d", game->potions_collected);
+    if (game->hints.enabled && game->hints.steps_left != NO_PATH)
+        len += snprintf(status+len, sizeof(status)-len, "  Steps left: %llu", (unsigned long long)game->hints.steps_left);
+    if (game->message) snprintf(status+len, sizeof(status)-len, "  %s", game->message);
+    if (strcmp(status, r->status) != 0){
+        r->backend->put_line(r->backend, view_rows(r, game), status);
+        strcpy(r->status, status);
+    }
+    r->backend->flush(r->backend);
+    r->frames++;
+    r->render_ns += now_ns() - start;
+    PROFILE_END(PHASE_FRAME, start);
+    PROFILE_COUNT(COUNT_BYTES_EMITTED, r->backend->bytes - bytes);
+}
+
+#define RENDER_BENCH_TRIES 16 // moves tried per frame asked for, at most
+
+/**
+ * Renders the first frame of game, then frames frames of a random walk
+ * of the player, and prints what the first frame and an average walking
+ * frame cost. A move into a wall draws nothing, so the walk gives up
+ * after RENDER_BENCH_TRIES moves per frame, in case the player cannot
+ * move at all. Draw game through the memory backend to measure the
+ * renderer alone.
+ */
+void render_bench(struct game *game, struct renderer *r, unsigned long frames, unsigned int seed){
+    struct maze_rng rng;
+    unsigned long bytes, tries;
+    uint64_t ns;
+
+    seed_rng(&rng, seed);
+    render_frame(r, game);
+    printf("first frame: %lu bytes, %.1f us\n", r->backend->bytes, r->render_ns/1e3);
+    bytes = r->backend->bytes;
+    ns = r->render_ns;
+    r->frames = 0;
+    for (tries = 0; r->frames < frames && tries/RENDER_BENCH_TRIES < frames; tries++){
+        long old_x = game->player_x;
+        long old_y = game->player_y;
+        if (move_player(game, rng_next(&rng) % 4)){
+            renderer_mark_move(r, game, old_x, old_y);
+            render_frame(r, game);
+        }
+    }
+    bytes = r->backend->bytes - bytes;
+    ns = r->render_ns - ns;
+    frames = r->frames;
+    if (frames == 0){
+        printf("0 frames: the player could not move\n");
+        return;
+    }
+    printf("%lu frames: %.1f bytes/frame, %.2f us/frame, %.0f frames/s\n", frames,
+           (double)bytes/frames, ns/1e3/frames, ns ? frames/(ns/1e9) : 0.0);
+}
+
+/**
+ * Plays keys as if they were typed, drawing through r, until they run
+ * out, the player escapes or a 'q' comes. Chars that are not movement
+ * keys are skipped. Prints how long the moves took to process and to
+ * draw, and where the game ended.
+ */
+void replay_moves(struct game *game, struct renderer *r, const char *keys, size_t n){
+    uint64_t start = now_ns();
+    uint64_t move_ns = 0, max_move_ns = 0, max_frame_ns = 0;
+    unsigned long moves = 0, blocked = 0, frames, bytes;
+    uint64_t render_ns;
+    size_t i;
+
+    render_frame(r, game);
+    frames = r->frames;
+    bytes = r->backend->bytes;
+    render_ns = r->render_ns;
+    for (i = 0; i < n && !game->escaped && keys[i] != 'q'; i++){
+        long old_x = game->player_x;
+        long old_y = game->player_y;
+        enum direction d;
+        uint64_t t, frame_ns;
+
+        if (key_direction(keys[i], &d) != 0) continue;
+        moves++;
+        t = now_ns();
+        if (!move_player(game, d)){
+            blocked++;
+            continue;
+        }
+        renderer_mark_move(r, game, old_x, old_y);
+        t = now_ns() - t;
+        move_ns += t;
+        if (t > max_move_ns) max_move_ns = t;
+        frame_ns = r->render_ns;
+        render_frame(r, game);
+        frame_ns = r->render_ns - frame_ns;
+        if (frame_ns > max_frame_ns) max_frame_ns = frame_ns;
+    }
+    frames = r->frames - frames;
+    bytes = r->backend->bytes - bytes;
+    render_ns = r->render_ns - render_ns;
+
+    printf("moves: %lu, %lu blocked by walls\n", moves, blocked);
+    if (moves > blocked)
+        printf("processing: %.3f us/move, %.3f us max\n", move_ns/1e3/(moves-blocked), max_move_ns/1e3);
+    if (frames > 0)
+        printf("rendering: %lu frames, %.3f us/frame, %.3f us max, %.1f bytes/frame\n", frames,
+               render_ns/1e3/frames, max_frame_ns/1e3, (double)bytes/frames);
+    printf("total: %.3f ms\n", (now_ns()-start)/1e6);
+    printf("player at row %ld, column %ld with %d potions%s\n", game->player_y, game->player_x,
+           game->potions_collected, game->escaped ? ", escaped" : "");
+}
+
+/**
+ * Plays game with the keys typed until the player escapes or quits,
+ * drawing at most fps frames a second (0 for no limit). Keys are read
+ * without blocking: all the keys waiting are applied in one go and their
+ * changes drawn in one frame, so held down keys never make the screen
+ * lag more than a frame behind. While unexplored chunks of an endless
+ * world are on the screen, it also wakes every PREFETCH_POLL_MS to draw
+ * those that arrived. Keys are saved to record if not NULL.
+ */
+void play(struct game *game, struct renderer *r, unsigned int fps, FILE *record){
+    uint64_t frame_ns = fps ? 1000000000 / fps : 0;
+    uint64_t last_frame = 0;
+    int pending = 0; // changes not drawn yet
+    int quit = 0;
+
+    nodelay(stdscr, TRUE);
+    render_frame(r, game); // print the maze for the first time
+    while (!game->escaped && !quit){
+        struct pollfd in = {STDIN_FILENO, POLLIN, 0};
+        int timeout = -1; // wait for keys
+        int input;
+
+        if (pending){ // or until the next frame is due
+            uint64_t now = now_ns();
+            timeout = now >= last_frame + frame_ns ? 0 : (last_frame + frame_ns - now + 999999) / 1000000;
+        }
+        if (r->holes && (timeout < 0 || timeout > PREFETCH_POLL_MS)) timeout = PREFETCH_POLL_MS;
+        if (timeout != 0) poll(&in, 1, timeout);
+        if (r->holes){ // or until the chunks missing arrive
+            world_collect(game->world);
+            pending |= game->world->arrived != r->arrived;
+        }
+
+        while (!game->escaped && !quit && (input = getch()) != ERR){ // drain the keys waiting
+            long old_x = game->player_x;
+            long old_y = game->player_y;
+            enum direction d;
+
+            if (input == KEY_RESIZE){ // the terminal changed size
+                pending |= renderer_resize(r) == 0;
+                continue;
+            }
+            if (input == 'h'){ // where to go next
+                show_hint(game);
+                pending = 1;
+                continue;
+            }
+            if (input == 'q'){ // quit the game at any time
+                quit = 1;
+            }else if (key_direction(input, &d) != 0){
+                continue;
+            }
+            if (record != NULL) fputc(input, record);
+            if (!quit && move_player(game, d)){
+                renderer_mark_move(r, game, old_x, old_y);
+                pending = 1;
+            }
+        }
+
+        if (pending && (game->escaped || now_ns() >= last_frame + frame_ns)){
+            render_frame(r, game); // refresh what changed
+            last_frame = now_ns();
+            pending = 0;
+        }
+    }
+    nodelay(stdscr, FALSE);
+}
+
+/**
+ * Reads the whole file at path into a new buffer and stores its size in
+ * *size. Returns the buffer, or NULL on error.
+ */
+char *read_file(const char *path, size_t *size){
+    FILE *f = fopen(path, "rb");
+    char *buf = NULL, *bigger;
+    size_t n = 0, max = 0;
+
+    if (f == NULL) return NULL;
+    do{
+        if (n == max){
+            max = max ? max*2 : 4096;
+            if ((bigger = MAZE_REALLOC(buf, max)) == NULL){
+                free(buf);
+                fclose(f);
+                return NULL;
+            }
+            buf = bigger;
+        }
+        n += fread(buf+n, 1, max-n, f);
+    }while (n == max);
+    if (ferror(f)){
+        free(buf);
+        buf = NULL;
+    }
+    fclose(f);
+    *size = n;
+    return buf;
+}
+
+/**
+ * Runs every solver from the entry cell to the exit cell and prints the
+ * path length, the cells expanded per second and the memory of each.
+ * Returns 0 on success, -1 if out of memory.
+ */
+int solve_bench(const struct packed_maze *pm){
+    uint32_t n = num_cells(pm);
+    unsigned int k;
+
+    if (n == 0) return -1;
+    printf("%-14s %12s %12s %10s %12s %10s\n", "solver", "length", "expanded", "ms", "Mnodes/s", "MB");
+    for (k = 0; k < NUM_SOLVERS; k++){
+        struct solve_stats stats = {0, 0, 0};
+        uint64_t start = now_ns(), ns;
+        if (solvers[k].solve(pm, 0, n-1, &stats) != 0) return -1;
+        ns = now_ns() - start;
+        printf("%-14s %12llu %12llu %10.2f %12.2f %10.2f\n", solvers[k].name,
+               (unsigned long long)stats.length, (unsigned long long)stats.expanded, ns/1e6,
+               ns ? stats.expanded*1e3/ns : 0.0, stats.memory/1048576.0);
+    }
+    return 0;
+}
+
+/**
+ * Prints the shortest route winning pm, and saves its keys to moves_file
+ * if not NULL (empty if pm cannot be won).
+ * Returns 0 on success, 1 if pm cannot be won, -1 if out of memory or
+ * moves_file can't be written.
+ */
+int print_route(const struct packed_maze *pm, const char *moves_file){
+    struct route route;
+    struct moves moves;
+    uint64_t start = now_ns();
+    unsigned int k;
+    int result = 0;
+
+    init_moves(&moves);
+    if (num_cells(pm) == 0 || solve_route(pm, &route, moves_file ? &moves : NULL) != 0){
+        free_moves(&moves);
+        return -1;
+    }
+    if (route.steps == NO_PATH){
+        printf("the maze cannot be won\n");
+        result = 1;
+    }else{
+        printf("route: %llu steps through the potions at", (unsigned long long)route.steps);
+        for (k = 0; k < NEEDED_POTIONS; k++)
+            printf("%s (%u, %u)", k ? "," : "", pm->items[route.potions[k]].row, pm->items[route.potions[k]].col);
+        printf(", found in %.2f ms\n", (now_ns()-start)/1e6);
+    }
+    if (moves_file != NULL){
+        FILE *f = fopen(moves_file, "w");
+        if (f == NULL || (moves.n > 0 && fwrite(moves.keys, 1, moves.n, f) != moves.n)) result = -1;
+        if (f != NULL && fclose(f) != 0) result = -1;
+    }
+    free_moves(&moves);
+    return result;
+}
+
+//-----------------------------------------------------------------------------
+
+/**
+ * Many agents walking one maze at once, for load tests. Wanderers step
+ * in a random open direction, wall followers keep the wall on their
+ * right, and solvers follow the distance field of the exit and start
+ * again from a random cell once they reach it. Every tick moves each
+ * agent at most one cell.
+ * The agents are kept as arrays of each field rather than an array of
+ * structs, so a tick streams through memory. They never write into the
+ * maze: occupied has a flag per cell, claimed with an atomic compare and
+ * swap before moving, so no two agents share a cell and agents can move
+ * from any thread. A tick is cut into blocks of SIM_BLOCK agents run
+ * by a pool of threads started once for the whole run (see sim_pool).
+ */
+enum agent_kind{
+    AGENT_WANDERER,
+    AGENT_WALL_FOLLOWER,
+    AGENT_SOLVER
+};
+
+#define NUM_AGENT_KINDS 3
+#define SIM_BLOCK 4096
+
+struct agents{
+    size_t n;
+    uint32_t *cell;        // index y*w+x of the cell of each agent
+    unsigned char *kind;   // enum agent_kind
+    unsigned char *facing; // enum direction a wall follower faces
+    uint64_t *rng;         // counter of the random draws of each agent
+};
+
+struct simulation{
+    const struct packed_maze *maze;
+    struct agents agents;
+    atomic_uchar *occupied;     // a flag per cell
+    struct distance_field exit; // for solvers
+    atomic_ulong moved;         // totals over every tick
+    atomic_ulong blocked;       // by another agent
+    atomic_ulong escaped;       // solvers which reached the exit
+};
+
+void free_simulation(struct simulation *sim){
+    free(sim->agents.cell);
+    free(sim->agents.kind);
+    free(sim->agents.facing);
+    free(sim->agents.rng);
+    free(sim->occupied);
+    free_distance_field(&sim->exit);
+    sim->agents.cell = NULL;
+    sim->agents.kind = NULL;
+    sim->agents.facing = NULL;
+    sim->agents.rng = NULL;
+    sim->occupied = NULL;
+}
+
+/**
+ * Sets up n agents on distinct random cells of pm, the same number of
+ * each kind. n must be at most half the cells.
+ * Returns 0 on success, -1 if out of memory.
+ */
+int init_simulation(struct simulation *sim, const struct packed_maze *pm, size_t n, int seed){
+    struct position exit = {packed_matrix_height(pm)-2, packed_matrix_width(pm)-1};
+    struct agents *a = &sim->agents;
+    struct maze_rng rng;
+    uint64_t *ranks = (uint64_t*)MAZE_MALLOC(n*sizeof(uint64_t));
+    size_t i;
+
+    sim->maze = pm;
+    a->n = n;
+    a->cell = (uint32_t*)MAZE_MALLOC(n*sizeof(uint32_t));
+    a->kind = (unsigned char*)MAZE_MALLOC(n);
+    a->facing = (unsigned char*)MAZE_MALLOC(n);
+    a->rng = (uint64_t*)MAZE_MALLOC(n*sizeof(uint64_t));
+    sim->occupied = (atomic_uchar*)MAZE_CALLOC(num_cells(pm), sizeof(atomic_uchar));
+    sim->exit.toward = NULL;
+    sim->exit.steps = NULL;
+    atomic_init(&sim->moved, 0);
+    atomic_init(&sim->blocked, 0);
+    atomic_init(&sim->escaped, 0);
+    seed_rng(&rng, seed);
+    if (ranks == NULL || a->cell == NULL || a->kind == NULL || a->facing == NULL || a->rng == NULL ||
+            sim->occupied == NULL || sample_ranks(&rng, num_cells(pm), ranks, n) != 0 ||
+            init_distance_field(&sim->exit, pm, exit) != 0){
+        free(ranks);
+        free_simulation(sim);
+        return -1;
+    }
+    qsort(ranks, n, sizeof(uint64_t), compare_ranks); // agents next to each other in memory are near in the maze
+    for (i = 0; i < n; i++){
+        a->cell[i] = ranks[i];
+        a->kind[i] = i % NUM_AGENT_KINDS;
+        a->facing[i] = DIR_RIGHT;
+        a->rng[i] = derive_seed(seed, i, 0) * 0x9e3779b97f4a7c15ULL;
+        atomic_store_explicit(&sim->occupied[a->cell[i]], 1, memory_order_relaxed);
+    }
+    free(ranks);
+    return 0;
+}
+
+/**
+ * Returns the direction a quarter turn clockwise from d.
+ */
+enum direction turn_right(enum direction d){
+    switch (d){
+        case DIR_UP: return DIR_RIGHT;
+        case DIR_RIGHT: return DIR_DOWN;
+        case DIR_DOWN: return DIR_LEFT;
+        default: return DIR_UP;
+    }
+}
+
+/**
+ * Claims cell for an agent if no agent is there.
+ * Returns whether it was claimed.
+ */
+int claim_cell(struct simulation *sim, uint32_t cell){
+    unsigned char expected = 0;
+    return atomic_compare_exchange_strong_explicit(&sim->occupied[cell], &expected, 1,
+                                                   memory_order_acquire, memory_order_relaxed);
+}
+
+/**
+ * Moves solver i to a random free cell.
+ */
+void respawn_agent(struct simulation *sim, size_t i){
+    struct agents *a = &sim->agents;
+    uint32_t n = num_cells(sim->maze), cell;
+    do cell = mix64(a->rng[i]++) % n; while (!claim_cell(sim, cell));
+    atomic_store_explicit(&sim->occupied[a->cell[i]], 0, memory_order_release);
+    a->cell[i] = cell;
+}
+
+/**
+ * Returns a random open direction out of cell (x, y) for agent i.
+ */
+enum direction random_open_direction(struct simulation *sim, size_t i, unsigned int x, unsigned int y){
+    unsigned int r = mix64(sim->agents.rng[i]++), k;
+    for (k = 0; k < 3 && !cell_open(sim->maze, x, y, (r+k)%4); k++);
+    return (r+k)%4;
+}
+
+/**
+ * Moves agent i one cell the way its kind chooses. When another agent is
+ * there, a wall follower or solver steps a random way instead, if that
+ * is free: agents keeping to their way could block each other for good.
+ * Counts the outcome in moved, blocked or escaped.
+ */
+void step_agent(struct simulation *sim, size_t i, unsigned long *moved, unsigned long *blocked, unsigned long *escaped){
+    const struct packed_maze *pm = sim->maze;
+    struct agents *a = &sim->agents;
+    uint32_t cell = a->cell[i], next;
+    unsigned int x = cell % pm->w, y = cell / pm->w;
+    enum direction d;
+    unsigned int k;
+
+    switch (a->kind[i]){
+        case AGENT_WANDERER:
+            d = random_open_direction(sim, i, x, y);
+            break;
+        case AGENT_WALL_FOLLOWER: // right, ahead, left, back: the first one open
+            d = turn_right(a->facing[i]);
+            for (k = 0; k < 3 && !cell_open(pm, x, y, d); k++) d = opposite_direction(turn_right(d));
+            break;
+        default: // out through the exit cell without waiting for it to be free
+            d = grid2_get(sim->exit.toward, pm->row_bytes, x, y);
+            if (cell == sim->exit.root || cell_neighbour(pm, cell, d) == sim->exit.root){
+                respawn_agent(sim, i);
+                (*escaped)++;
+                return;
+            }
+    }
+    next = cell_neighbour(pm, cell, d);
+    if (!claim_cell(sim, next) && (a->kind[i] == AGENT_WANDERER ||
+            !claim_cell(sim, next = cell_neighbour(pm, cell, d = random_open_direction(sim, i, x, y))))){
+        (*blocked)++;
+        return;
+    }
+    atomic_store_explicit(&sim->occupied[cell], 0, memory_order_release);
+    a->cell[i] = next;
+    a->facing[i] = d;
+    (*moved)++;
+}
+
+/**
+ * Steps the agents of block b.
+ */
+void simulate_block(struct simulation *sim, size_t b){
+    size_t i, end = (b+1)*SIM_BLOCK < sim->agents.n ? (b+1)*SIM_BLOCK : sim->agents.n;
+    unsigned long moved = 0, blocked = 0, escaped = 0;
+
+    for (i = b*SIM_BLOCK; i < end; i++) step_agent(sim, i, &moved, &blocked, &escaped);
+    atomic_fetch_add(&sim->moved, moved);
+    atomic_fetch_add(&sim->blocked, blocked);
+    atomic_fetch_add(&sim->escaped, escaped);
+}
+
+/**
+ * The threads running the ticks of a simulation. They are started once
+ * and meet at a barrier after every tick, instead of being started and
+ * joined for each one. Each thread owns a deque of blocks, refilled at
+ * the start of a tick with the same run of blocks every time, so its
+ * agents stay in its cache. It takes blocks from the front of its deque
+ * and, once that is empty, steals them from the back of the others.
+ * A deque is the range of blocks [first, end) packed in one word, so
+ * taking from either end is a single compare and swap.
+ */
+struct sim_deque{
+    atomic_uint_least64_t range; // first block in the low half, end in the high half
+    struct sim_pool *pool;
+    unsigned int index;
+    pthread_t thread;
+    char pad[64];                // keeps the ranges of two threads off one cache line
+};
+
+struct sim_pool{
+    struct simulation *sim;
+    struct sim_deque *deques;
+    unsigned int threads;
+    size_t blocks;
+    unsigned long ticks;
+    atomic_ulong stolen;      // blocks run by a thread other than their owner
+    pthread_mutex_t lock;     // guards the barrier
+    pthread_cond_t wake;
+    unsigned int waiting;     // threads at the barrier
+    unsigned long generation; // times the barrier opened
+};
+
+/**
+ * Waits until every thread of pool is here. The barrier is made of a
+ * mutex and a condition rather than a pthread_barrier_t, since how many
+ * threads could be started is only known once they run.
+ */
+void sim_pool_wait(struct sim_pool *pool){
+    unsigned long generation;
+    pthread_mutex_lock(&pool->lock);
+    generation = pool->generation;
+    if (++pool->waiting == pool->threads){
+        pool->waiting = 0;
+        pool->generation++;
+        pthread_cond_broadcast(&pool->wake);
+    }else{
+        while (generation == pool->generation) pthread_cond_wait(&pool->wake, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * Takes a block from the front of deque, or from the back when steal is
+ * set, and stores it in *b.
+ * Returns whether there was one.
+ */
+int sim_deque_take(struct sim_deque *deque, int steal, size_t *b){
+    uint64_t range = atomic_load_explicit(&deque->range, memory_order_relaxed), next;
+    uint32_t first, end;
+    do{
+        first = (uint32_t)range;
+        end = (uint32_t)(range >> 32);
+        if (first >= end) return 0;
+        *b = steal ? end-1 : first;
+        next = steal ? (uint64_t)(end-1) << 32 | first : (uint64_t)end << 32 | (first+1);
+    }while (!atomic_compare_exchange_weak_explicit(&deque->range, &range, next,
+                                                   memory_order_relaxed, memory_order_relaxed));
+    return 1;
+}
+
+/**
+ * Runs every tick of deque's pool as one of its threads: refills its
+ * deque, empties it, steals from the others until they are all empty,
+ * then waits for the rest at the barrier. Thread 0 also times the ticks.
+ */
+void *sim_pool_worker(void *p){
+    struct sim_deque *deque = (struct sim_deque*)p;
+    struct sim_pool *pool = deque->pool;
+    size_t first, end, b;
+    unsigned long t, stolen = 0;
+    unsigned int k;
+
+    sim_pool_wait(pool); // until every thread has started and the deques are set
+    first = pool->blocks * deque->index / pool->threads;
+    end = pool->blocks * (deque->index+1) / pool->threads;
+    for (t = 0; t < pool->ticks; t++){
+        PROFILE_START(tick);
+        atomic_store_explicit(&deque->range, (uint64_t)end << 32 | first, memory_order_relaxed);
+        while (sim_deque_take(deque, 0, &b)) simulate_block(pool->sim, b);
+        for (k = 1; k < pool->threads; k++){
+            struct sim_deque *victim = &pool->deques[(deque->index+k) % pool->threads];
+            while (sim_deque_take(victim, 1, &b)){
+                simulate_block(pool->sim, b);
+                stolen++;
+            }
+        }
+        sim_pool_wait(pool);
+        if (deque->index == 0){
+            PROFILE_END(PHASE_TICK, tick);
+        }
+    }
+    atomic_fetch_add(&pool->stolen, stolen);
+    return NULL;
+}
+
+/**
+ * Runs ticks ticks of sim on up to threads threads, the calling thread
+ * being one of them, and stores how many were started in *started.
+ * Returns the number of blocks stolen, or -1 if out of memory.
+ */
+long run_sim_pool(struct simulation *sim, unsigned long ticks, unsigned int threads, unsigned int *started){
+    struct sim_pool pool;
+    unsigned int t;
+
+    pool.sim = sim;
+    pool.blocks = (sim->agents.n+SIM_BLOCK-1)/SIM_BLOCK;
+    pool.ticks = ticks;
+    if (threads > pool.blocks) threads = pool.blocks;
+    if (threads == 0) threads = 1;
+    if ((pool.deques = (struct sim_deque*)MAZE_CALLOC(threads, sizeof(struct sim_deque))) == NULL) return -1;
+    atomic_init(&pool.stolen, 0);
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.wake, NULL);
+    pool.waiting = 0;
+    pool.generation = 0;
+    for (t = 0; t < threads; t++){
+        atomic_init(&pool.deques[t].range, 0);
+        pool.deques[t].pool = &pool;
+        pool.deques[t].index = t;
+    }
+    pthread_mutex_lock(&pool.lock); // the workers wait for the number of threads at the first barrier
+    for (t = 1; t < threads; t++)
+        if (pthread_create(&pool.deques[t].thread, NULL, sim_pool_worker, &pool.deques[t]) != 0) break;
+    pool.threads = t;
+    pthread_mutex_unlock(&pool.lock);
+    sim_pool_worker(&pool.deques[0]);
+    for (t = 1; t < pool.threads; t++) pthread_join(pool.deques[t].thread, NULL);
+    pthread_cond_destroy(&pool.wake);
+    pthread_mutex_destroy(&pool.lock);
+    free(pool.deques);
+    *started = pool.threads;
+    return (long)atomic_load(&pool.stolen);
+}
+
+/**
+ * Runs ticks ticks of n agents on pm with threads threads (0 for one per
+ * processor) and prints the agent-steps per second.
+ * Returns 0 on success, -1 if out of memory.
+ */
+int simulate(const struct packed_maze *pm, size_t n, unsigned long ticks, unsigned int threads, int seed){
+    struct simulation sim;
+    uint64_t start, ns;
+    long stolen;
+
+    if (init_simulation(&sim, pm, n, seed) != 0) return -1;
+    if (threads == 0) threads = default_threads();
+    start = now_ns();
+    if ((stolen = run_sim_pool(&sim, ticks, threads, &threads)) < 0){
+        free_simulation(&sim);
+        return -1;
+    }
+    ns = now_ns() - start;
+    printf("%zu agents (wanderers, wall followers and solvers) on %u x %u cells, %u threads\n",
+           n, pm->w, pm->h, threads);
+    printf("%lu ticks: %.3f ms/tick, %ld blocks of %d agents stolen\n", ticks, ticks ? ns/1e6/ticks : 0.0,
+           stolen, SIM_BLOCK);
+    printf("agent-steps: %lu moved, %lu blocked, %lu escapes; %.2f M agent-steps/s\n",
+           (unsigned long)sim.moved, (unsigned long)sim.blocked, (unsigned long)sim.escaped,
+           ns ? (double)n*ticks*1e3/ns : 0.0);
+    free_simulation(&sim);
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+
+/**
+ * Benchmark and regression check of the generators. Every maze of
+ * bench_configs is generated as a char matrix by gen_maze and as a
+ * packed maze by gen_packed_maze, and the FNV-1a hash of its chars,
+ * potions included, must match the hash recorded when the table was
+ * made: a seed must always give the same maze. The speed can also be
+ * checked against a baseline saved by an earlier run.
+ */
+struct bench_config{
+    unsigned int width, height, cell_size;
+    int seed;
+    uint64_t hash;
+};
+
+const struct bench_config bench_configs[] = {
+    {40, 25, 1, 1, 0xc06cd1600b2d1920ULL},
+    {40, 25, 1, 2024, 0xc7d75df301f8768cULL},
+    {40, 25, 3, 1, 0x8bf9be058583c252ULL},
+    {40, 25, 3, 2024, 0x6e55e792979151d8ULL},
+    {40, 25, 5, 1, 0x96a356e1cfddbd36ULL},
+    {40, 25, 5, 2024, 0x3a0fd0b3c1709e60ULL},
+    {300, 200, 1, 1, 0xc2dc440dcfe941beULL},
+    {300, 200, 1, 2024, 0x75177b9e7a044774ULL},
+    {300, 200, 3, 1, 0xd06cc134756f1848ULL},
+    {300, 200, 3, 2024, 0xb7b124c3cbe72e52ULL},
+    {300, 200, 5, 1, 0x9f721092b2e41412ULL},
+    {300, 200, 5, 2024, 0xa8c86d01658d9766ULL},
+    {1500, 1000, 1, 1, 0xeecc91b6d45e609cULL},
+    {1500, 1000, 1, 2024, 0x0fdaa0547db74822ULL},
+    {1500, 1000, 3, 1, 0xd683710ff6667b40ULL},
+    {1500, 1000, 3, 2024, 0xb6a6c2fa3c9f7b0aULL},
+    {1500, 1000, 5, 1, 0xf98791f7bc8a9c32ULL},
+    {1500, 1000, 5, 2024, 0xc9582088f8818aa0ULL},
+};
+
+#define NUM_BENCH_CONFIGS (sizeof(bench_configs)/sizeof(bench_configs[0]))
+
+/**
+ * Mazes --bench also solves, with far more potions than solve_route
+ * routes through: the route must have the length it always had, and
+ * the run must finish however many potions there are.
+ */
+struct bench_solve{
+    unsigned int width, height, cell_size;
+    int seed;
+    unsigned int potions;
+    uint64_t steps;
+};
+
+const struct bench_solve bench_solves[] = {
+    {200, 200, 1, 1, 2000, 11614},
+    {200, 200, 3, 2024, 100000, 27474},
+};
+
+#define NUM_BENCH_SOLVES (sizeof(bench_solves)/sizeof(bench_solves[0]))
+#define BENCH_MIN_RUNS 3
+#define BENCH_MAX_RUNS 50
+#define BENCH_MIN_NS 100000000 // keep running a maze until this long, for a steady best time
+#define BENCH_CHECK_NS 1000000 // faster runs are too noisy to compare with a baseline
+
+struct bench_result{
+    double cells_per_s; // of the best run
+    uint64_t best_ns;
+    unsigned int runs;
+    uint64_t hash;
+    long peak_kb;                    // growth of resident memory while generating, -1 if unknown
+    unsigned long long allocations;  // of one generation
+};
+
+const char *bench_generators[] = {"matrix", "packed"};
+
+uint64_t fnv1a(uint64_t hash, const char *s, size_t n){
+    size_t i;
+    for (i = 0; i < n; i++){
+        hash ^= (unsigned char)s[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+#define FNV1A_START 14695981039346656037ULL
+
+/**
+ * Returns the hash of the chars of a maze made by gen_maze, row by row.
+ */
+uint64_t matrix_hash(const struct maze *maze){
+    uint64_t hash = FNV1A_START;
+    unsigned int row;
+    for (row = 0; row < maze->h; row++) hash = fnv1a(hash, &MAZE_AT(maze, row, 0), maze->w);
+    return hash;
+}
+
+/**
+ * Returns the hash of the chars of pm, the same as matrix_hash of the
+ * same maze as a char matrix. line must hold a matrix row.
+ */
+uint64_t packed_hash(const struct packed_maze *pm, char *line){
+    uint64_t hash = FNV1A_START;
+    unsigned int row, mw = packed_matrix_width(pm);
+    for (row = 0; row < packed_matrix_height(pm); row++){
+        packed_expand_row(pm, row, 0, mw, line);
+        hash = fnv1a(hash, line, mw);
+    }
+    return hash;
+}
+
+/**
+ * Returns the value in kB of field (like "VmRSS:") of /proc/self/status,
+ * or -1 if there is none.
+ */
+long status_kb(const char *field){
+    FILE *f = fopen("/proc/self/status", "r");
+    char line[256];
+    size_t len = strlen(field);
+    long kb = -1;
+
+    if (f == NULL) return -1;
+    while (kb < 0 && fgets(line, sizeof(line), f) != NULL)
+        if (strncmp(line, field, len) == 0 && sscanf(line+len, "%ld", &kb) != 1) kb = -1;
+    fclose(f);
+    return kb;
+}
+
+/**
+ * Starts a new measure of rss_growth_kb: sets the peak resident memory
+ * of the program back to what it uses now. Memory still in use from
+ * earlier work is in both, so it does not count; the memory freed since
+ * is handed back to the system first where the C library can, so using
+ * it again does.
+ * Returns the resident memory in kB, or -1 where the peak can't be reset.
+ */
+long reset_peak_rss(void){
+    FILE *f;
+#ifdef __GLIBC__
+    malloc_trim(0);
+#endif
+    if ((f = fopen("/proc/self/clear_refs", "w")) == NULL) return -1;
+    if (fputs("5", f) == EOF){
+        fclose(f);
+        return -1;
+    }
+    if (fclose(f) != 0) return -1;
+    return status_kb("VmRSS:");
+}
+
+/**
+ * Returns how far in kB the resident memory rose above rss, what
+ * reset_peak_rss returned, or -1 if unknown.
+ */
+long rss_growth_kb(long rss){
+    long peak = rss < 0 ? -1 : status_kb("VmHWM:");
+    if (peak < 0) return -1;
+    return peak > rss ? peak - rss : 0;
+}
+
+/**
+ * Generates the maze of c with generator 0 (gen_maze) or 1
+ * (gen_packed_maze) at least BENCH_MIN_RUNS times and for BENCH_MIN_NS,
+ * and stores the best time and what the first run cost into r.
+ * Returns 0 on success, -1 if out of memory.
+ */
+int bench_generator(const struct bench_config *c, int generator, struct bench_result *r){
+    struct maze_gen gen;
+    struct maze maze;
+    struct packed_maze pm;
+    uint64_t total = 0;
+    unsigned long long allocations = profile_counter(COUNT_ALLOCATIONS);
+    char *line = NULL;
+    int result = 0;
+    long rss;
+
+    init_maze_gen(&gen, c->width, c->height, c->cell_size, c->seed);
+    init_maze(&maze);
+    init_packed_maze(&pm);
+    rss = reset_peak_rss();
+    r->best_ns = UINT64_MAX;
+    for (r->runs = 0; r->runs < BENCH_MAX_RUNS && (r->runs < BENCH_MIN_RUNS || total < BENCH_MIN_NS); r->runs++){
+        uint64_t start = now_ns(), ns;
+        if ((generator ? gen_packed_maze(&gen, &pm) : gen_maze(&gen, &maze)) != 0){
+            result = -1;
+            break;
+        }
+        ns = now_ns() - start;
+        total += ns;
+        if (ns < r->best_ns) r->best_ns = ns;
+        if (r->runs == 0) r->allocations = profile_counter(COUNT_ALLOCATIONS) - allocations;
+    }
+    r->peak_kb = rss_growth_kb(rss);
+    if (result == 0 && generator){
+        if ((line = MAZE_MALLOC(packed_matrix_width(&pm))) == NULL) result = -1;
+        else r->hash = packed_hash(&pm, line);
+    }else if (result == 0){
+        r->hash = matrix_hash(&maze);
+    }
+    r->cells_per_s = (double)c->width*c->height*1e9/(r->best_ns ? r->best_ns : 1);
+    free(line);
+    free_maze(&maze);
+    free_packed_maze(&pm);
+    return result;
+}
+
+/**
+ * Generates the maze of s and finds its shortest winning route, storing
+ * its steps into *steps and the time taken into *ns.
+ * Returns 0 on success, -1 if out of memory.
+ */
+int bench_solve_route(const struct bench_solve *s, uint64_t *steps, uint64_t *ns){
+    struct maze_gen gen;
+    struct packed_maze pm;
+    struct route route;
+    uint64_t start;
+    int result;
+
+    init_maze_gen(&gen, s->width, s->height, s->cell_size, s->seed);
+    gen.num_potions = s->potions;
+    init_packed_maze(&pm);
+    if (gen_packed_maze(&gen, &pm) != 0) return -1;
+    start = now_ns();
+    result = solve_route(&pm, &route, NULL);
+    *ns = now_ns() - start;
+    *steps = route.steps;
+    free_packed_maze(&pm);
+    return result;
+}
+
+/**
+ * Reads the cells per second of each config and generator from a
+ * baseline file written by save_bench_baseline into speeds, 0 where it
+ * has none.
+ * Returns 0 on success, -1 if the file can't be read.
+ */
+int load_bench_baseline(const char *path, double speeds[][2]){
+    FILE *f = fopen(path, "r");
+    struct bench_config c;
+    char generator[16];
+    double speed;
+    size_t k;
+    int g;
+
+    if (f == NULL) return -1;
+    memset(speeds, 0, NUM_BENCH_CONFIGS*sizeof(*speeds));
+    while (fscanf(f, "%u %u %u %d %15s %lf", &c.width, &c.height, &c.cell_size, &c.seed, generator, &speed) == 6){
+        for (k = 0; k < NUM_BENCH_CONFIGS; k++){
+            const struct bench_config *b = &bench_configs[k];
+            if (b->width != c.width || b->height != c.height || b->cell_size != c.cell_size || b->seed != c.seed)
+                continue;
+            for (g = 0; g < 2; g++)
+                if (strcmp(generator, bench_generators[g]) == 0) speeds[k][g] = speed;
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+/**
+ * Writes the cells per second of each config and generator to path, a
+ * line "width height cell_size seed generator cells_per_s" each.
+ * Returns 0 on success, -1 if the file can't be written.
+ */
+int save_bench_baseline(const char *path, double speeds[][2]){
+    FILE *f = fopen(path, "w");
+    size_t k;
+    int g;
+
+    if (f == NULL) return -1;
+    for (k = 0; k < NUM_BENCH_CONFIGS; k++)
+        for (g = 0; g < 2; g++)
+            fprintf(f, "%u %u %u %d %s %.0f\n", bench_configs[k].width, bench_configs[k].height,
+                    bench_configs[k].cell_size, bench_configs[k].seed, bench_generators[g], speeds[k][g]);
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+/**
+ * Runs both generators on every maze of bench_configs and prints their
+ * speed, memory, allocations and hash. Speeds depend on the machine, so
+ * they are only checked against a baseline_file, recorded on the same
+ * machine: with one that exists, a generator more than tolerance percent
+ * slower than in it fails the run; one that does not exist is written
+ * with the speeds measured.
+ * The memory is how much the resident memory grew while generating, on
+ * top of what earlier mazes left.
+ * Returns 0 if every hash matches and nothing is slower, 1 if not, -1 if
+ * out of memory or the baseline can't be written.
+ */
+int run_bench(const char *baseline_file, double tolerance){
+    double (*baseline)[2] = MAZE_CALLOC(NUM_BENCH_CONFIGS, sizeof(*baseline));
+    double (*speeds)[2] = MAZE_CALLOC(NUM_BENCH_CONFIGS, sizeof(*speeds));
+    int have_baseline = 0, result = 0;
+    unsigned int changed = 0, slower = 0;
+    size_t k;
+    int g;
+
+    if (baseline == NULL || speeds == NULL){
+        free(baseline);
+        free(speeds);
+        return -1;
+    }
+    if (baseline_file != NULL) have_baseline = load_bench_baseline(baseline_file, baseline) == 0;
+    printf("%-9s %6s %6s %3s %6s %5s %10s %9s %8s %7s %-16s\n", "generator", "width", "height", "cs", "seed",
+           "runs", "best ms", "Mcells/s", "+RSS MB", "allocs", "hash");
+    for (k = 0; k < NUM_BENCH_CONFIGS && result == 0; k++){
+        const struct bench_config *c = &bench_configs[k];
+        for (g = 0; g < 2; g++){
+            struct bench_result r;
+            if (bench_generator(c, g, &r) != 0){
+                result = -1;
+                break;
+            }
+            speeds[k][g] = r.cells_per_s;
+            printf("%-9s %6u %6u %3u %6d %5u %10.3f %9.2f ", bench_generators[g], c->width, c->height,
+                   c->cell_size, c->seed, r.runs, r.best_ns/1e6, r.cells_per_s/1e6);
+            if (r.peak_kb >= 0) printf("%8.1f ", r.peak_kb/1024.0);
+            else printf("%8s ", "-");
+            if (PROFILING) printf("%7llu ", r.allocations);
+            else printf("%7s ", "-");
+            printf("%016llx", (unsigned long long)r.hash);
+            if (r.hash != c->hash){
+                printf(" CHANGED, was %016llx", (unsigned long long)c->hash);
+                changed++;
+            }
+            if (have_baseline && baseline[k][g] > 0 && r.best_ns >= BENCH_CHECK_NS && r.cells_per_s < baseline[k][g]*(1 - tolerance/100)){
+                printf(" SLOWER, was %.2f Mcells/s", baseline[k][g]/1e6);
+                slower++;
+            }
+            printf("\n");
+        }
+    }
+    for (k = 0; k < NUM_BENCH_SOLVES && result == 0; k++){
+        const struct bench_solve *s = &bench_solves[k];
+        uint64_t steps, ns;
+        if (bench_solve_route(s, &steps, &ns) != 0){
+            result = -1;
+            break;
+        }
+        printf("route of %ux%u, cs %u, seed %d with %u potions: %llu steps, %.3f ms", s->width, s->height,
+               s->cell_size, s->seed, s->potions, (unsigned long long)steps, ns/1e6);
+        if (steps != s->steps){
+            printf(" CHANGED, was %llu", (unsigned long long)s->steps);
+            changed++;
+        }
+        printf("\n");
+    }
+    if (result == 0){
+        printf("%zu mazes generated, %zu solved, %u changed, %u slower than the baseline\n", 2*NUM_BENCH_CONFIGS,
+               NUM_BENCH_SOLVES, changed, slower);
+        if (changed > 0 || slower > 0) result = 1;
+    }
+    if (result >= 0 && baseline_file != NULL && !have_baseline){
+        if (save_bench_baseline(baseline_file, speeds) != 0) result = -1;
+        else printf("baseline written to %s\n", baseline_file);
+    }
+    free(baseline);
+    free(speeds);
+    return result;
+}
+
+/**
+ * Prints the command line options.
+ */
+void print_usage(const char *program){
+    printf("Usage: %s [options]\n", program);
+    printf("Maze parameters not given as options are asked for.\n");
+    printf("  -W, --width N        width of the maze in cells\n");
+    printf("  -H, --height N       height of the maze in cells\n");
+    printf("  -c, --cell-size N    chars per cell side (an odd number)\n");
+    printf("  -s, --seed N         seed of the maze\n");
+    printf("  -f, --fog N          fog radius, 0 for no fog\n");
+    printf("      --fps N          draw at most N frames a second, 0 for no limit\n");
+    printf("                       (default 60)\n");
+    printf("      --sight          the fog also hides what walls block from view\n");
+    printf("      --remember       keep the parts of the maze already seen drawn\n");
+    printf("      --no-hints       no hint key (h) and no steps left on the status\n");
+    printf("                       line, saving the memory of their distance fields\n");
+    printf("      --stream FILE    write the maze to FILE ('-' for stdout) row by row\n");
+    printf("                       while it is generated, instead of playing;\n");
+    printf("                       memory does not grow with the height\n");
+    printf("      --save FILE      save the maze to FILE instead of playing\n");
+    printf("      --load FILE      play the maze saved in FILE\n");
+    printf("      --potions N      potions in the maze (default and minimum %d)\n", NEEDED_POTIONS);
+    printf("      --endless        play a maze without end, generated as it is explored;\n");
+    printf("                       only the cell size and seed are used\n");
+    printf("      --tile-size N    generate in tiles of N cells a side, in parallel\n");
+    printf("      --threads N      threads for tiled generation and --simulate, 0 for one\n");
+    printf("                       per processor\n");
+    printf("      --render-bench N draw N frames of a random walk without a terminal\n");
+    printf("                       instead of playing, and print their cost\n");
+    printf("      --screen RxC     screen size without a terminal (default 24x80)\n");
+    printf("      --moves KEYS     play the moves in KEYS (like wwdds) without a\n");
+    printf("                       terminal, and print how long they took\n");
+    printf("      --replay FILE    same as --moves with the keys in FILE\n");
+    printf("      --record FILE    save the keys played to FILE, to replay them\n");
+    printf("      --solve          print the shortest route collecting the potions\n");
+    printf("                       to the exit instead of playing\n");
+    printf("      --solve-moves FILE  same as --solve, also saving the keys of the\n");
+    printf("                       route to FILE for --replay\n");
+    printf("      --solve-bench    time every solver from the entry to the exit\n");
+    printf("      --simulate N     run N agents (wanderers, wall followers and solvers)\n");
+    printf("                       in the maze instead of playing, and print the\n");
+    printf("                       agent-steps per second\n");
+    printf("      --ticks N        ticks of --simulate (default 100)\n");
+    printf("      --bench          generate a grid of mazes with both generators, print\n");
+    printf("                       their speed, memory and allocations, and fail if a\n");
+    printf("                       maze differs from the one its seed always gave\n");
+    printf("      --bench-baseline FILE  same as --bench, also failing if a generator is\n");
+    printf("                       slower than in FILE, recorded on this machine;\n");
+    printf("                       FILE is written if missing\n");
+    printf("      --bench-tolerance PCT  slowdown allowed by --bench-baseline (default 25)\n");
+    printf("      --profile FILE   write the time of each phase (generation, moves,\n");
+    printf("                       frames...), its latency histogram and counters to\n");
+    printf("                       FILE on exit, as CSV if FILE ends in .csv, else JSON\n");
+    printf("  -h, --help           show this help\n");
+}
+
+const char *profile_file; // where --profile writes the profile, or NULL
+
+/**
+ * Writes the profile to profile_file, for atexit, so that it is written
+ * however the program ends.
+ */
+void write_profile_at_exit(void){
+    if (write_profile(profile_file) != 0)
+        fprintf(stderr, "could not write the profile to %s\n", profile_file);
+}
+
+/**
+ * Parses a whole decimal number from text into *value.
+ * Returns 0 on success, -1 if text is not a number.
+ */
+int parse_number(const char *text, long *value){
+    char *end;
+    *value = strtol(text, &end, 10);
+    return (*text == '\0' || *end != '\0') ? -1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned int width; // vars to ask the player
+    unsigned int height;
+    unsigned int cell_size;
+    int seed;
+    int fog_radius;
+    int have_width = 0, have_height = 0, have_cell_size = 0, have_seed = 0, have_fog_radius = 0;
+    int line_of_sight = 0;
+    int remember = 0;
+    int hints = 1;
+    unsigned int tile_size = 0;
+    unsigned int threads = 0;
+    unsigned int num_potions = NEEDED_POTIONS;
+    const char *stream_file = NULL;
+    const char *save_file = NULL;
+    const char *load_file = NULL;
+    int endless = 0;
+    struct maze_gen gen;
+    struct world world;
+
+    // command line options
+    enum {
+        OPT_STREAM = 256,
+        OPT_SAVE,
+        OPT_LOAD,
+        OPT_TILE_SIZE,
+        OPT_THREADS,
+        OPT_SIGHT,
+        OPT_REMEMBER,
+        OPT_RENDER_BENCH,
+        OPT_SCREEN,
+        OPT_MOVES,
+        OPT_REPLAY,
+        OPT_RECORD,
+        OPT_FPS,
+        OPT_SOLVE,
+        OPT_SOLVE_MOVES,
+        OPT_SOLVE_BENCH,
+        OPT_NO_HINTS,
+        OPT_POTIONS,
+        OPT_ENDLESS,
+        OPT_SIMULATE,
+        OPT_TICKS,
+        OPT_PROFILE,
+        OPT_BENCH,
+        OPT_BENCH_BASELINE,
+        OPT_BENCH_TOLERANCE
+    };
+    static const struct option options[] = {
+        {"width", required_argument, NULL, 'W'},
+        {"height", required_argument, NULL, 'H'},
+        {"cell-size", required_argument, NULL, 'c'},
+        {"seed", required_argument, NULL, 's'},
+        {"fog", required_argument, NULL, 'f'},
+        {"stream", required_argument, NULL, OPT_STREAM},
+        {"save", required_argument, NULL, OPT_SAVE},
+        {"load", required_argument, NULL, OPT_LOAD},
+        {"tile-size", required_argument, NULL, OPT_TILE_SIZE},
+        {"threads", required_argument, NULL, OPT_THREADS},
+        {"sight", no_argument, NULL, OPT_SIGHT},
+        {"remember", no_argument, NULL, OPT_REMEMBER},
+        {"render-bench", required_argument, NULL, OPT_RENDER_BENCH},
+        {"screen", required_argument, NULL, OPT_SCREEN},
+        {"moves", required_argument, NULL, OPT_MOVES},
+        {"replay", required_argument, NULL, OPT_REPLAY},
+        {"record", required_argument, NULL, OPT_RECORD},
+        {"fps", required_argument, NULL, OPT_FPS},
+        {"solve", no_argument, NULL, OPT_SOLVE},
+        {"solve-moves", required_argument, NULL, OPT_SOLVE_MOVES},
+        {"solve-bench", no_argument, NULL, OPT_SOLVE_BENCH},
+        {"no-hints", no_argument, NULL, OPT_NO_HINTS},
+        {"potions", required_argument, NULL, OPT_POTIONS},
+        {"endless", no_argument, NULL, OPT_ENDLESS},
+        {"simulate", required_argument, NULL, OPT_SIMULATE},
+        {"ticks", required_argument, NULL, OPT_TICKS},
+        {"profile", required_argument, NULL, OPT_PROFILE},
+        {"bench", no_argument, NULL, OPT_BENCH},
+        {"bench-baseline", required_argument, NULL, OPT_BENCH_BASELINE},
+        {"bench-tolerance", required_argument, NULL, OPT_BENCH_TOLERANCE},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+    long value = 0;
+
+    struct game game;
+    struct renderer renderer;
+    struct render_backend backend;
+    struct framebuffer framebuffer;
+    struct terminal terminal;
+    unsigned long bench_frames = 0;
+    const char *replay_file = NULL;
+    const char *record_file = NULL;
+    FILE *record = NULL;
+    char *script = NULL; // keys to play instead of reading them
+    size_t script_size = 0;
+    int headless;
+    int screen_rows = 24, screen_cols = 80;
+    unsigned int fps = 60;
+    int solve = 0, bench_solvers = 0;
+    unsigned long sim_agents = 0, sim_ticks = 100;
+    int bench = 0;
+    const char *bench_baseline = NULL;
+    double bench_tolerance = 25;
+    const char *solve_moves = NULL;
+    int failed;
+
+    while ((opt = getopt_long(argc, argv, "W:H:c:s:f:h", options, NULL)) != -1){
+        int numeric = opt == OPT_TILE_SIZE || opt == OPT_THREADS || opt == OPT_RENDER_BENCH || opt == OPT_FPS ||
+                      opt == OPT_POTIONS || opt == OPT_SIMULATE || opt == OPT_TICKS || opt == OPT_BENCH_TOLERANCE ||
+                      (opt < 256 && strchr("WHcsf", opt) != NULL);
+        if (numeric && parse_number(optarg, &value) != 0){
+            fprintf(stderr, "%s: '%s' is not a number\n", argv[0], optarg);
+            return 1;
+        }
+        if (numeric && (opt == 's' || opt == 'f' ? value < INT_MIN || value > INT_MAX : value < 0 || value > UINT_MAX)){
+            fprintf(stderr, "%s: %s is out of range\n", argv[0], optarg);
+            return 1;
+        }
+        switch (opt){
+            case 'W':
+                if (value < 1){
+                    fprintf(stderr, "%s: the width must be at least 1\n", argv[0]);
+                    return 1;
+                }
+                width = value;
+                have_width = 1;
+                break;
+            case 'H':
+                if (value < 1){
+                    fprintf(stderr, "%s: the height must be at least 1\n", argv[0]);
+                    return 1;
+                }
+                height = value;
+                have_height = 1;
+                break;
+            case 'c':
+                if (value < 1 || value%2 == 0){
+                    fprintf(stderr, "%s: the cell size must be an odd number\n", argv[0]);
+                    return 1;
+                }
+                cell_size = value;
+                have_cell_size = 1;
+                break;
+            case 's': seed = value; have_seed = 1; break;
+            case 'f': fog_radius = value; have_fog_radius = 1; break;
+            case OPT_STREAM: stream_file = optarg; break;
+            case OPT_SAVE: save_file = optarg; break;
+            case OPT_LOAD: load_file = optarg; break;
+            case OPT_TILE_SIZE: tile_size = value; break;
+            case OPT_THREADS:
+                if (value > MAX_THREADS){
+                    fprintf(stderr, "%s: at most %d threads\n", argv[0], MAX_THREADS);
+                    return 1;
+                }
+                threads = value;
+                break;
+            case OPT_SIGHT: line_of_sight = 1; break;
+            case OPT_REMEMBER: remember = 1; break;
+            case OPT_RENDER_BENCH: bench_frames = value; break;
+            case OPT_SCREEN:
+                if (sscanf(optarg, "%dx%d", &screen_rows, &screen_cols) != 2 || screen_rows < 2 || screen_cols < 1){
+                    fprintf(stderr, "%s: '%s' is not a screen size like 24x80\n", argv[0], optarg);
+                    return 1;
+                }
+                break;
+            case OPT_MOVES:
+                free(script);
+                script_size = strlen(optarg);
+                if ((script = MAZE_MALLOC(script_size+1)) != NULL) memcpy(script, optarg, script_size+1);
+                break;
+            case OPT_REPLAY: replay_file = optarg; break;
+            case OPT_RECORD: record_file = optarg; break;
+            case OPT_FPS: fps = value; break;
+            case OPT_SOLVE: solve = 1; break;
+            case OPT_SOLVE_MOVES: solve = 1; solve_moves = optarg; break;
+            case OPT_SOLVE_BENCH: bench_solvers = 1; break;
+            case OPT_NO_HINTS: hints = 0; break;
+            case OPT_POTIONS:
+                if (value < NEEDED_POTIONS){
+                    fprintf(stderr, "%s: at least %d potions are needed to win\n", argv[0], NEEDED_POTIONS);
+                    return 1;
+                }
+                num_potions = value;
+                break;
+            case OPT_ENDLESS: endless = 1; break;
+            case OPT_SIMULATE: sim_agents = value; break;
+            case OPT_TICKS: sim_ticks = value; break;
+            case OPT_PROFILE:
+                if (!PROFILING){
+                    fprintf(stderr, "%s: built without profiling (MAZE_NO_PROFILE)\n", argv[0]);
+                    return 1;
+                }
+                profile_file = optarg;
+                break;
+            case OPT_BENCH: bench = 1; break;
+            case OPT_BENCH_BASELINE: bench = 1; bench_baseline = optarg; break;
+            case OPT_BENCH_TOLERANCE:
+                if (value < 0 || value >= 100){
+                    fprintf(stderr, "%s: the tolerance must be from 0 to 99 percent\n", argv[0]);
+                    return 1;
+                }
+                bench_tolerance = value;
+                break;
+            case 'h':
+                print_usage(argv[0]);
+                return 0;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (profile_file != NULL) atexit(write_profile_at_exit);
+
+    if (bench){ // check the generators, no game
+        int checked = run_bench(bench_baseline, bench_tolerance);
+        if (checked < 0 && bench_baseline != NULL)
+            fprintf(stderr, "%s: out of memory or could not write %s\n", argv[0], bench_baseline);
+        else if (checked < 0)
+            fprintf(stderr, "%s: out of memory\n", argv[0]);
+        return checked != 0;
+    }
+
+    if (endless && (stream_file != NULL || save_file != NULL || load_file != NULL || solve || bench_solvers || sim_agents > 0)){
+        fprintf(stderr, "%s: an endless maze cannot be streamed, saved, loaded, solved or simulated\n", argv[0]);
+        return 1;
+    }
+
+    if (stream_file != NULL){ // generate straight to a file, no game
+        FILE *out;
+        if (!have_width || !have_height || !have_cell_size || !have_seed){
+            fprintf(stderr, "%s: --stream needs --width, --height, --cell-size and --seed\n", argv[0]);
+            return 1;
+        }
+        if (check_maze_size(width, 1, cell_size) != 0 || check_maze_size(1, height, cell_size) != 0){ // any number of cells
+            fprintf(stderr, "%s: cannot make a maze of %u x %u cells of size %u\n", argv[0], width, height, cell_size);
+            return 1;
+        }
+        out = strcmp(stream_file, "-") == 0 ? stdout : fopen(stream_file, "w");
+        if (out == NULL || stream_maze(out, width, height, cell_size, seed, num_potions) != 0){
+            fprintf(stderr, "%s: could not write the maze to %s\n", argv[0], stream_file);
+            return 1;
+        }
+        if (out != stdout) fclose(out);
+        return 0;
+    }
+
+    struct packed_maze my_maze;  // only the walls are stored, chars are produced when drawn
+    init_packed_maze(&my_maze);
+
+    // ask the user for parameters--------------------------
+    if (replay_file != NULL && (script = read_file(replay_file, &script_size)) == NULL){
+        fprintf(stderr, "%s: could not read moves from %s\n", argv[0], replay_file);
+        return 1;
+    }
+    headless = bench_frames > 0 || script != NULL || solve || bench_solvers || sim_agents > 0;
+    if (record_file != NULL && !headless && (record = fopen(record_file, "w")) == NULL){
+        fprintf(stderr, "%s: could not record moves to %s\n", argv[0], record_file);
+        free(script);
+        return 1;
+    }
+
+    if (save_file == NULL && !headless) printf("Press 'q' in maze to quit.\n");
+    if (load_file != NULL){ // the file has everything but the fog
+        if (load_packed_maze(&my_maze, load_file) != 0){
+            fprintf(stderr, "%s: %s is not a maze file\n", argv[0], load_file);
+            return 1;
+        }
+    }else if (endless){ // chunks are generated as the player goes
+        if (!have_cell_size){
+            printf("Enter size for the cell (enter an odd number): ");
+            scanf("%d", &cell_size);
+        }
+        if (!have_seed){
+            printf("Enter a value for the seed: ");
+            scanf("%d", &seed);
+        }
+        if (check_maze_size(CHUNK_CELLS, CHUNK_CELLS, cell_size) != 0){
+            fprintf(stderr, "%s: the cell size must be an odd number\n", argv[0]);
+            return 1;
+        }
+        if (init_world(&world, cell_size, seed, WORLD_CACHE_CHUNKS) != 0){
+            printf("Not enough memory for an endless maze.\n");
+            return 1;
+        }
+        world.wait = headless; // scripted moves must not depend on how fast chunks arrive
+    }else{
+        if (!have_width){
+            printf("Enter a width: ");
+            scanf("%d", &width);
+        }
+        if (!have_height){
+            printf("Enter a height: ");
+            scanf("%d", &height);
+        }
+        if (!have_cell_size){
+            printf("Enter size for the cell (enter an odd number): ");
+            scanf("%d", &cell_size);
+        }
+        if (!have_seed){
+            printf("Enter a value for the seed: ");
+            scanf("%d", &seed);
+        }
+        if (check_maze_size(width, height, cell_size) != 0){
+            fprintf(stderr, "%s: cannot make a maze of %u x %u cells of size %u\n", argv[0], width, height, cell_size);
+            return 1;
+        }
+
+        init_maze_gen(&gen, width, height, cell_size, seed);
+        gen.tile_size = tile_size;
+        gen.threads = threads;
+        gen.num_potions = num_potions;
+        if (gen_packed_maze(&gen, &my_maze) != 0){ // creat a new maze
+            printf("Not enough memory for a maze of that size.\n");
+            return 1;
+        }
+    }
+
+    if (save_file != NULL){ // keep the maze for later, no game
+        int saved = save_packed_maze(&my_maze, save_file);
+        free_packed_maze(&my_maze);
+        if (saved != 0){
+            fprintf(stderr, "%s: could not save the maze to %s\n", argv[0], save_file);
+            return 1;
+        }
+        return 0;
+    }
+
+    if (solve || bench_solvers){ // check the maze, no game
+        int failed_solving = bench_solvers && solve_bench(&my_maze) != 0;
+        int routed = solve && !failed_solving ? print_route(&my_maze, solve_moves) : 0;
+        free_packed_maze(&my_maze);
+        free(script);
+        if (failed_solving || routed < 0){
+            fprintf(stderr, "%s: could not solve the maze\n", argv[0]);
+            return 1;
+        }
+        return routed != 0; // a maze that cannot be won fails too
+    }
+
+    if (sim_agents > 0){ // load test, no game
+        int failed_simulation = 1;
+        if (sim_agents > num_cells(&my_maze)/2)
+            fprintf(stderr, "%s: a maze of %u cells has room for %u agents at most\n", argv[0],
+                    num_cells(&my_maze), num_cells(&my_maze)/2);
+        else if (simulate(&my_maze, sim_agents, sim_ticks, threads, my_maze.seed) != 0)
+            fprintf(stderr, "%s: not enough memory for %lu agents\n", argv[0], sim_agents);
+        else
+            failed_simulation = 0;
+        free_packed_maze(&my_maze);
+        free(script);
+        return failed_simulation;
+    }
+
+    if (!have_fog_radius && !headless){
+        printf("Enter a fog radius: ");
+        scanf("%d", &fog_radius);
+    }
+
+    // spawn player at the entrance
+    if (endless) failed = init_endless_game(&game, &world, fog_radius, line_of_sight) != 0;
+    else failed = init_game(&game, &my_maze, fog_radius, line_of_sight, remember, hints) != 0;
+    if (!failed && headless) failed = init_memory_backend(&backend, &framebuffer, screen_rows, screen_cols) != 0;
+    else if (!failed) init_curses_backend(&backend, &terminal);
+    if (!failed && init_renderer(&renderer, &backend) != 0){
+        backend.close(&backend);
+        free_renderer(&renderer);
+        failed = 1;
+    }
+    if (failed){
+        printf("Not enough memory for the fog, the hints and the screen.\n");
+        free_game(&game);
+        free_packed_maze(&my_maze);
+        if (endless) free_world(&world);
+        free(script);
+        return 1;
+    }
+
+    if (bench_frames > 0){ // measure the renderer instead of playing
+        render_bench(&game, &renderer, bench_frames, endless ? world.seed : my_maze.seed);
+    }else if (script != NULL){ // play the moves given instead of keys
+        replay_moves(&game, &renderer, script, script_size);
+    }else{
+        play(&game, &renderer, fps, record);
+    }
+
+    if (game.escaped && !headless){
+        backend.clear_all(&backend);
+        backend.put_line(&backend, 0, "You have escaped the maze! Press any key to exit.");
+        backend.flush(&backend);
+        getch();
+    }
+    backend.close(&backend);
+    if (record != NULL) fclose(record);
+    free(script);
+    free_renderer(&renderer);
+    if (endless && headless)
+        printf("chunks: %lu generated while waiting, %lu ahead of the player\n", world.generated, world.prefetched);
+    free_game(&game);
+    free_packed_maze(&my_maze);
+    if (endless) free_world(&world);
+    return 0;
+}